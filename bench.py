@@ -0,0 +1,236 @@
+# Headless benchmark of the teststand: runs a scripted batch of commands, then reports the sweep timing,
+# the link throughput and errors and the noise of every channel, to compare firmware builds on the same rig.
+#
+#   python bench.py --port COM3 [--script bench.json] [--tag build-name] [--out reports]
+#   python bench.py --compare reports/old.json reports/new.json [--tolerance 0.1]
+
+import argparse
+import csv
+import json
+import os
+import statistics
+import sys
+import time
+import serial
+from datetime import datetime
+from teststand import SERIAL_BAUD, FAST_SERIAL_BAUD, STATS_CHANNELS, LinkStats, command, set_protocol
+
+#
+# Parameters
+#
+
+COMMAND_TIMEOUT = 120  # Longest gap between two messages of one command
+STATS_TIMEOUT = 2
+DEFAULT_TOLERANCE = 0.1  # Relative increase of a metric reported as a regression
+
+# Batch run when no script is given, each entry is a controller command, "repeat" runs it several times
+DEFAULT_SCRIPT = [
+    {'command_type': 'quick_init'},
+    {'command_type': 'measure', 'steps': 10, 'throttle_scale': 0.3, 'stream': True, 'repeat': 3}
+]
+
+# Metrics compared between two reports, all of them lower is better
+COMPARED_METRICS = ('wall_s', 'first_step_s', 'step_interval_s', 'settle_ms', 'malformed', 'dropped', 'missing') + \
+    tuple(f'noise_{channel}' for channel in STATS_CHANNELS)
+
+#
+# Functions
+#
+
+def mean(values):
+    return statistics.mean(values) if len(values) > 0 else None
+
+
+# Run one command and measure it, the steps are returned apart for the csv.
+def run_command(ser, cmd, protocol):
+    link = LinkStats()
+    arrivals = []
+    start_t = time.time()
+    result = command(ser, cmd, cmd['command_type'], COMMAND_TIMEOUT, on_record=lambda record: arrivals.append(time.time()),
+                     protocol=protocol, link=link)
+    wall_s = time.time() - start_t
+
+    run = {
+        'command': cmd,
+        'ok': result != None and result.get('ok', False),
+        'error': 'timeout' if result == None else result.get('error'),
+        'wall_s': wall_s,
+        'bytes': link.bytes,
+        'messages': link.messages,
+        'malformed': link.malformed,
+        'throughput_bps': link.bytes / wall_s if wall_s > 0 else 0.0
+    }
+    steps = result.get('data', []) if result != None else []
+    if result != None and 'trip' in result:
+        run['trip'] = result['trip']['reason']
+    if result != None and 'controller_id' in result:
+        run['controller_id'] = result['controller_id']
+    if len(arrivals) > 0:
+        intervals = [b - a for a, b in zip(arrivals, arrivals[1:])]
+        run['first_step_s'] = arrivals[0] - start_t
+        run['step_interval_s'] = mean(intervals)
+        run['step_interval_max_s'] = max(intervals, default=None)
+    if result != None and 'count' in result:
+        run['dropped'] = result.get('dropped', 0)
+        run['missing'] = result['count'] - len(steps)
+
+    settle = [step['settle_ms'] for step in steps if 'settle_ms' in step]
+    run['settle_ms'] = mean(settle)
+    # Noise: mean spread of the samples behind every step
+    for channel in STATS_CHANNELS:
+        spread = [step['stats'][channel]['std'] for step in steps if 'stats' in step]
+        run[f'noise_{channel}'] = mean(spread)
+    return run, steps
+
+
+# Read the self-profiling counters of the controller, reset gives a fresh interval for the batch.
+def firmware_stats(ser, protocol, reset=False):
+    result = command(ser, {'command_type': 'stats', 'reset': reset}, 'stats', STATS_TIMEOUT, protocol=protocol)
+    if result == None:
+        print('Reading the controller stats failed.')
+    return result
+
+
+# Run the whole script and write the report (json) and every measured step (csv) to out_dir.
+def run_bench(args):
+    script = DEFAULT_SCRIPT
+    if args.script != None:
+        with open(args.script) as f:
+            script = json.load(f)
+
+    # serial_for_url also opens the simulator of the native build (socket://localhost:port)
+    ser = serial.serial_for_url(args.port, SERIAL_BAUD, timeout=1)
+    protocol = 'json'
+    if args.protocol == 'binary':
+        protocol = set_protocol(ser, protocol, 'binary', args.baud)
+    firmware_stats(ser, protocol, reset=True)
+
+    runs = []
+    step_rows = []
+    for i, entry in enumerate(script):
+        cmd = dict(entry)
+        repeat = cmd.pop('repeat', 1)
+        # Runs are sent one by one, so every run is timed on its own
+        for r in range(repeat):
+            print(f'[{i}] {cmd["command_type"]} run {r + 1}/{repeat}')
+            run, steps = run_command(ser, cmd, protocol)
+            run['key'] = f'{i}:{cmd["command_type"]}'
+            run['run'] = r
+            runs.append(run)
+            for seq, step in enumerate(steps):
+                row = {'key': run['key'], 'run': r, 'seq': seq}
+                row.update({k: v for k, v in step.items() if k != 'stats'})
+                for channel, spread in step.get('stats', {}).items():
+                    row.update({f'{channel}_{k}': v for k, v in spread.items()})
+                step_rows.append(row)
+            if not run['ok']:
+                print(f'[{i}] failed: {run["error"]}')
+
+    stats = firmware_stats(ser, protocol)
+    if protocol != 'json':
+        set_protocol(ser, protocol, 'json', SERIAL_BAUD)
+    ser.close()
+
+    report = {
+        'tag': args.tag,
+        'date': datetime.now().isoformat(timespec='seconds'),
+        'port': args.port,
+        'protocol': protocol,
+        'baud': args.baud if protocol == 'binary' else SERIAL_BAUD,
+        'script': script,
+        'summary': summarize(runs),
+        'runs': runs,
+        'firmware': stats
+    }
+    os.makedirs(args.out, exist_ok=True)
+    name = f'{args.tag}_{datetime.now().strftime("%y%m%d-%H%M%S")}'
+    with open(f'{args.out}/{name}.json', 'w') as f:
+        json.dump(report, f, indent=4)
+    if len(step_rows) > 0:
+        columns = list(dict.fromkeys(k for row in step_rows for k in row))
+        with open(f'{args.out}/{name}_steps.csv', 'w', newline='') as f:
+            writer = csv.DictWriter(f, fieldnames=columns)
+            writer.writeheader()
+            writer.writerows(step_rows)
+    print(f'Report saved to {args.out}/{name}.json')
+    print_summary(report['summary'])
+
+
+# Average the metrics of the runs of every script entry.
+def summarize(runs):
+    summary = {}
+    for key in dict.fromkeys(run['key'] for run in runs):
+        group = [run for run in runs if run['key'] == key]
+        entry = {'runs': len(group), 'failed': sum(not run['ok'] for run in group)}
+        for metric in COMPARED_METRICS + ('throughput_bps',):
+            entry[metric] = mean([run[metric] for run in group if run.get(metric) != None])
+        summary[key] = entry
+    return summary
+
+
+def print_summary(summary):
+    for key, entry in summary.items():
+        metrics = ', '.join(f'{metric}: {value:.4g}' for metric, value in entry.items() if value != None)
+        print(f'{key}: {metrics}')
+
+
+# Compare the summary and the firmware stage timings of two reports, return the regressions found.
+def compare(old, new, tolerance):
+    regressions = []
+
+    def check(name, old_value, new_value):
+        if old_value == None or new_value == None:
+            return
+        change = (new_value - old_value) / old_value if old_value != 0 else (0.0 if new_value == 0 else float('inf'))
+        flag = change > tolerance
+        print(f'{"REGRESSION" if flag else "ok":<10} {name:<40} {old_value:>12.4g} {new_value:>12.4g} {change:+8.1%}')
+        if flag:
+            regressions.append(name)
+
+    for key, new_entry in new['summary'].items():
+        old_entry = old['summary'].get(key)
+        if old_entry == None:
+            continue
+        for metric in COMPARED_METRICS:
+            check(f'{key} {metric}', old_entry.get(metric), new_entry.get(metric))
+
+    old_stages = (old.get('firmware') or {}).get('stages', {})
+    new_stages = (new.get('firmware') or {}).get('stages', {})
+    for stage, new_stage in new_stages.items():
+        old_stage = old_stages.get(stage)
+        if old_stage != None and old_stage['n'] > 0 and new_stage['n'] > 0:
+            check(f'stage {stage} mean_us', old_stage['mean_us'], new_stage['mean_us'])
+    return regressions
+
+
+def run_compare(args):
+    with open(args.compare[0]) as f:
+        old = json.load(f)
+    with open(args.compare[1]) as f:
+        new = json.load(f)
+    print(f'{"":<10} {"metric":<40} {old["tag"]:>12} {new["tag"]:>12}')
+    regressions = compare(old, new, args.tolerance)
+    print(f'{len(regressions)} regression(s) over {args.tolerance:.0%}.')
+    return 1 if len(regressions) > 0 else 0
+
+#
+# Main
+#
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Teststand benchmark and regression harness')
+    parser.add_argument('--port', help='Serial port of the controller, or socket://localhost:port of the simulator')
+    parser.add_argument('--script', help='JSON list of the commands to run (default: quick_init and 3 streamed sweeps)')
+    parser.add_argument('--protocol', choices=('json', 'binary'), default='binary')
+    parser.add_argument('--baud', type=int, default=FAST_SERIAL_BAUD, help='Baud used with the binary protocol')
+    parser.add_argument('--tag', default='build', help='Name of the firmware build under test')
+    parser.add_argument('--out', default='./bench_reports', help='Directory of the reports')
+    parser.add_argument('--compare', nargs=2, metavar=('OLD', 'NEW'), help='Compare two reports instead of running')
+    parser.add_argument('--tolerance', type=float, default=DEFAULT_TOLERANCE)
+    args = parser.parse_args()
+
+    if args.compare != None:
+        sys.exit(run_compare(args))
+    if args.port == None:
+        parser.error('--port is required to run a benchmark')
+    run_bench(args)
@@ -0,0 +1,218 @@
+# Test history of the teststand: every run is appended as Parquet files (its steps, and the raw capture
+# around a trip if any) under one dataset directory, next to an index of all runs keyed by motor, prop,
+# battery, firmware build and date. Queries read the index first, then memory-map only the runs they need.
+#
+#   python dataset.py import <root> <storage dir>...   # Add the runs saved by the GUI before the dataset existed
+#   python dataset.py list <root> [--prop-in 18] [--motor 2806]
+#   python dataset.py plot <root> --x rpm --y efficiency [--prop-in 18]
+
+import argparse
+import json
+import os
+import re
+import sys
+import uuid
+import pandas as pd
+from datetime import datetime
+
+#
+# Parameters
+#
+
+INDEX_FILE = 'index.parquet'
+RUNS_DIR = 'runs'
+CAPTURES_DIR = 'captures'
+CAPTURE_CHANNELS = ('adc', 'thrust', 'rpm')  # capture_<channel>.csv written by dump_capture()
+
+# Columns of the index, one row per run
+INDEX_COLUMNS = ['run_id', 'date', 'session_name', 'motor', 'prop', 'prop_in', 'battery', 'firmware',
+                 'controller_id', 'mode', 'output_scale', 'steps', 'ok', 'error', 'trip', 'capture']
+
+#
+# Functions
+#
+
+# Diameter in inches of a prop named like '18x6.1' or '1855', None if the name does not start with it.
+def prop_inches(prop):
+    match = re.match(r'\s*(\d+(?:\.\d+)?)', prop or '')
+    if match == None:
+        return None
+    inches = float(match.group(1))
+    # '1855' is an 18 x 5.5 prop
+    return inches // 100 if inches >= 100 else inches
+
+
+def load_index(root):
+    path = f'{root}/{INDEX_FILE}'
+    if not os.path.exists(path):
+        return pd.DataFrame(columns=INDEX_COLUMNS)
+    return pd.read_parquet(path)
+
+
+# Replace the index in one step, a reader never sees it half written.
+def save_index(root, index):
+    path = f'{root}/{INDEX_FILE}'
+    index.to_parquet(f'{path}.tmp', index=False)
+    os.replace(f'{path}.tmp', path)
+
+
+# Append one run: meta is the measure_param of the GUI (session_name, motor, prop, battery, firmware, trip, ...),
+# data the steps as the GUI holds them, capture_dir the csv files of a capture dump. Failed and tripped runs
+# are kept as well, with their error and trip reason. Return its run_id.
+def add_run(root, meta, data, capture_dir=None):
+    os.makedirs(f'{root}/{RUNS_DIR}', exist_ok=True)
+    date = datetime.fromisoformat(meta['date']) if 'date' in meta else datetime.now()
+    run_id = f'{date.strftime("%y%m%d-%H%M%S")}_{uuid.uuid4().hex[:6]}'
+
+    steps = data.copy()
+    steps.columns = [column.replace('.', '_') for column in steps.columns]  # stats.rpm.std -> stats_rpm_std
+    steps.to_parquet(f'{root}/{RUNS_DIR}/{run_id}.parquet', index=False)
+
+    if capture_dir != None and not os.path.exists(f'{capture_dir}/capture.json'):
+        capture_dir = None
+    if capture_dir != None:
+        os.makedirs(f'{root}/{CAPTURES_DIR}', exist_ok=True)
+        for channel in CAPTURE_CHANNELS:
+            samples = pd.read_csv(f'{capture_dir}/capture_{channel}.csv')
+            samples.to_parquet(f'{root}/{CAPTURES_DIR}/{run_id}_{channel}.parquet', index=False)
+
+    row = {
+        'run_id': run_id,
+        'date': pd.Timestamp(date),
+        'session_name': meta.get('session_name'),
+        'motor': meta.get('motor'),
+        'prop': meta.get('prop'),
+        'prop_in': prop_inches(meta.get('prop')),
+        'battery': meta.get('battery'),
+        'firmware': meta.get('firmware'),
+        'controller_id': meta.get('controller_id'),
+        'mode': meta.get('mode'),
+        'output_scale': meta.get('output_scale'),
+        'steps': len(steps),
+        'ok': meta.get('ok', True),  # The GUI only saved the completed runs before it recorded ok
+        'error': meta.get('error'),
+        'trip': meta.get('trip'),
+        'capture': capture_dir  # Source of the samples in CAPTURES_DIR, None without a capture
+    }
+    index = load_index(root)
+    index = pd.concat([index, pd.DataFrame([row], columns=INDEX_COLUMNS)], ignore_index=True)
+    save_index(root, index)
+    return run_id
+
+
+# Runs of the index matching every filter given, e.g. query(root, prop_in=18, motor='2806').
+# Text fields match case-insensitively on any part of the name, numbers exactly.
+def query(root, **filters):
+    index = load_index(root)
+    for column, value in filters.items():
+        if value == None:
+            continue
+        if isinstance(value, str):
+            index = index[index[column].fillna('').str.contains(value, case=False, regex=False)]
+        else:
+            index = index[index[column] == value]
+    return index
+
+
+# Steps of the given runs in one frame, tagged with their index row. Only the columns asked for are read,
+# straight from the memory-mapped files.
+def load_steps(root, runs, columns=None):
+    frames = []
+    for _, run in runs.iterrows():
+        steps = pd.read_parquet(f'{root}/{RUNS_DIR}/{run["run_id"]}.parquet', columns=columns, memory_map=True)
+        for key in ('run_id', 'session_name', 'motor', 'prop', 'battery', 'firmware'):
+            steps[key] = run[key]
+        frames.append(steps)
+    if len(frames) == 0:
+        return pd.DataFrame(columns=(columns or []) + ['run_id'])
+    return pd.concat(frames, ignore_index=True)
+
+
+# Raw capture of one run with a capture, channel is one of CAPTURE_CHANNELS.
+def load_capture(root, run_id, channel):
+    return pd.read_parquet(f'{root}/{CAPTURES_DIR}/{run_id}_{channel}.parquet', memory_map=True)
+
+
+# Power and efficiency of every step, as visualize() of the GUI derives them.
+def with_derived(steps):
+    steps = steps.copy()
+    steps['power'] = steps['voltage'] * steps['current']
+    steps['efficiency'] = steps['thrust'] / steps['power']
+    return steps
+
+
+# Add the runs the GUI saved as measure_param.json + data.csv directories.
+def import_dirs(root, storage_dirs):
+    for storage_dir in storage_dirs:
+        try:
+            with open(f'{storage_dir}/measure_param.json') as f:
+                meta = json.load(f)
+            data = pd.read_csv(f'{storage_dir}/data.csv')
+        except (OSError, ValueError) as e:
+            print(f'Skipping {storage_dir}: {e}')
+            continue
+        # The date of the old runs is only kept in their directory name
+        match = re.search(r'_(\d{6}-\d{4})$', os.path.normpath(storage_dir))
+        if 'date' not in meta and match != None:
+            meta['date'] = datetime.strptime(match.group(1), '%y%m%d-%H%M').isoformat()
+        capture_dir = f'{storage_dir}/capture' if os.path.exists(f'{storage_dir}/capture') else None
+        print(f'{storage_dir} -> {add_run(root, meta, data, capture_dir)}')
+
+
+def print_runs(runs):
+    if len(runs) == 0:
+        print('No runs.')
+        return
+    with pd.option_context('display.max_rows', None, 'display.width', 200):
+        print(runs.to_string(index=False))
+
+
+# Overlay y vs x of every run matching the filters.
+def plot_runs(root, x, y, filters):
+    import matplotlib.pyplot as plt
+    runs = query(root, **filters)
+    runs = runs[runs['steps'] > 0]  # A run tripped before its first step has nothing to plot
+    steps = with_derived(load_steps(root, runs, columns=['throttle', 'rpm', 'thrust', 'current', 'voltage']))
+    fig, ax = plt.subplots(figsize=(10, 6))
+    for run_id, run_steps in steps.groupby('run_id', sort=False):
+        first = run_steps.iloc[0]
+        ax.plot(run_steps[x], run_steps[y], label=f'{first["session_name"]} ({first["motor"]}, {first["prop"]}, {first["battery"]})')
+    ax.set_xlabel('throttle (% of output_scale)' if x == 'throttle' else x)
+    ax.set_ylabel(y)
+    ax.set_title(f'{y} vs {x}, {len(runs)} run(s)')
+    ax.legend(fontsize='small')
+    plt.show()
+
+#
+# Main
+#
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Teststand run history')
+    subparsers = parser.add_subparsers(dest='action', required=True)
+    import_parser = subparsers.add_parser('import', help='Add the runs saved by the GUI')
+    import_parser.add_argument('root', help='Dataset directory')
+    import_parser.add_argument('dirs', nargs='+', help='Storage directories of the runs')
+    for name in ('list', 'plot'):
+        subparser = subparsers.add_parser(name)
+        subparser.add_argument('root', help='Dataset directory')
+        subparser.add_argument('--motor')
+        subparser.add_argument('--prop')
+        subparser.add_argument('--prop-in', type=float, help='Prop diameter, inches')
+        subparser.add_argument('--battery')
+        subparser.add_argument('--firmware')
+        subparser.add_argument('--session')
+        if name == 'plot':
+            subparser.add_argument('--x', default='rpm', choices=('throttle', 'rpm'))
+            subparser.add_argument('--y', default='efficiency', choices=('power', 'thrust', 'current', 'efficiency'))
+    args = parser.parse_args()
+
+    if args.action == 'import':
+        import_dirs(args.root, args.dirs)
+        sys.exit(0)
+    filters = {'motor': args.motor, 'prop': args.prop, 'prop_in': args.prop_in, 'battery': args.battery,
+               'firmware': args.firmware, 'session_name': args.session}
+    if args.action == 'list':
+        print_runs(query(args.root, **filters))
+    else:
+        plot_runs(args.root, args.x, args.y, filters)
@@ -0,0 +1,153 @@
+# Drives several teststands from one session: every controller runs the same script on its own port and
+# thread, side by side, and the steps of all of them are merged into one dataset tagged with the stand.
+#
+#   python fleet.py --ports COM3 COM4 COM5 [--script fleet.json] [--out fleet_runs]
+
+import argparse
+import csv
+import json
+import os
+import sys
+import threading
+import serial
+from datetime import datetime
+from bench import run_command
+from teststand import SERIAL_BAUD, FAST_SERIAL_BAUD, set_protocol
+
+#
+# Parameters
+#
+
+INIT_COMMANDS = ('sys_init', 'quick_init')
+
+# Script run when none is given, each entry is a controller command, "repeat" runs it several times
+DEFAULT_SCRIPT = [
+    {'command_type': 'sys_init'},
+    {'command_type': 'measure', 'steps': 10, 'throttle_scale': 0.3, 'stream': True}
+]
+
+print_lock = threading.Lock()
+
+#
+# Functions
+#
+
+def log(stand, message):
+    with print_lock:
+        print(f'[{stand.name}] {message}')
+
+
+# One controller of the fleet, running the whole script on its own port.
+# Its id comes from the first init reply, a script without one starts with a sys_init.
+class Stand(threading.Thread):
+    def __init__(self, port, script, protocol, baud):
+        super().__init__(name=port, daemon=True)
+        self.port = port
+        self.script = script if script[0]['command_type'] in INIT_COMMANDS else [{'command_type': 'sys_init'}] + script
+        self.protocol = protocol
+        self.baud = baud
+        self.controller_id = None
+        self.runs = []
+        self.rows = []
+        self.error = None
+
+    def run(self):
+        try:
+            ser = serial.serial_for_url(self.port, SERIAL_BAUD, timeout=1)
+        except serial.SerialException as e:
+            self.error = str(e)
+            log(self, f'Opening the port failed: {e}')
+            return
+        protocol = 'json'
+        if self.protocol == 'binary':
+            protocol = set_protocol(ser, protocol, 'binary', self.baud)
+
+        for i, entry in enumerate(self.script):
+            cmd = dict(entry)
+            repeat = cmd.pop('repeat', 1)
+            for r in range(repeat):
+                run, steps = run_command(ser, cmd, protocol)
+                run['key'] = f'{i}:{cmd["command_type"]}'
+                run['run'] = r
+                self.runs.append(run)
+                self.add_steps(run, steps)
+                log(self, f'{run["key"]} run {r + 1}/{repeat}: {"ok" if run["ok"] else run["error"]}')
+                # Nothing more runs on a stand that failed its checks, or that lost its link
+                if not run['ok'] and (cmd['command_type'] in INIT_COMMANDS or run['error'] == 'timeout'):
+                    self.error = f'{run["key"]} failed: {run["error"]}'
+                    break
+            if self.error != None:
+                break
+
+        if protocol != 'json':
+            set_protocol(ser, protocol, 'json', SERIAL_BAUD)
+        ser.close()
+
+    def add_steps(self, run, steps):
+        if self.controller_id == None and 'controller_id' in run:
+            self.controller_id = run['controller_id']
+            log(self, f'Controller {self.controller_id}')
+        for seq, step in enumerate(steps):
+            row = {'controller_id': self.controller_id, 'port': self.port, 'key': run['key'], 'run': run['run'], 'seq': seq}
+            row.update({k: v for k, v in step.items() if k != 'stats'})
+            for channel, spread in step.get('stats', {}).items():
+                row.update({f'{channel}_{k}': v for k, v in spread.items()})
+            self.rows.append(row)
+
+
+# Run the script on every stand at once, then merge their steps (csv) and runs (json) into out_dir.
+def run_fleet(args):
+    script = DEFAULT_SCRIPT
+    if args.script != None:
+        with open(args.script) as f:
+            script = json.load(f)
+
+    stands = [Stand(port, script, args.protocol, args.baud) for port in args.ports]
+    for stand in stands:
+        stand.start()
+    for stand in stands:
+        stand.join()
+
+    ids = [stand.controller_id for stand in stands if stand.controller_id != None]
+    if len(set(ids)) != len(ids):
+        print('Several ports reported the same controller id, check the port list!')
+
+    report = {
+        'date': datetime.now().isoformat(timespec='seconds'),
+        'script': script,
+        'stands': [{
+            'port': stand.port,
+            'controller_id': stand.controller_id,
+            'error': stand.error,
+            'runs': stand.runs
+        } for stand in stands]
+    }
+    os.makedirs(args.out, exist_ok=True)
+    name = f'fleet_{datetime.now().strftime("%y%m%d-%H%M%S")}'
+    with open(f'{args.out}/{name}.json', 'w') as f:
+        json.dump(report, f, indent=4)
+    rows = [row for stand in stands for row in stand.rows]
+    if len(rows) > 0:
+        columns = list(dict.fromkeys(k for row in rows for k in row))
+        with open(f'{args.out}/{name}_steps.csv', 'w', newline='') as f:
+            writer = csv.DictWriter(f, fieldnames=columns)
+            writer.writeheader()
+            writer.writerows(rows)
+    print(f'Fleet run saved to {args.out}/{name}.json')
+    for stand in stands:
+        print(f'{stand.port} ({stand.controller_id}): {len(stand.rows)} steps, {stand.error or "ok"}')
+    return 1 if any(stand.error != None for stand in stands) else 0
+
+#
+# Main
+#
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Run one script on several teststands at once')
+    parser.add_argument('--ports', nargs='+', required=True, help='Serial ports (or socket:// urls) of the controllers')
+    parser.add_argument('--script', help='JSON list of the commands to run (default: sys_init and a streamed sweep)')
+    parser.add_argument('--protocol', choices=('json', 'binary'), default='binary')
+    parser.add_argument('--baud', type=int, default=FAST_SERIAL_BAUD, help='Baud used with the binary protocol')
+    parser.add_argument('--out', default='./fleet_runs', help='Directory of the merged dataset')
+    args = parser.parse_args()
+    sys.exit(run_fleet(args))
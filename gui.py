@@ -4,21 +4,49 @@ import PySimpleGUI as sg
 import serial
 import serial.tools.list_ports
 import json
-import time
 import os
+import time
+import numpy as np
 import pandas as pd
 import matplotlib.pyplot as plt
+from matplotlib.widgets import Button
 import shutil
 from datetime import datetime
+from teststand import SERIAL_BAUD, FAST_SERIAL_BAUD, Session
+from dataset import add_run
 
 #
 # Parameters
 #
 
+CONNECT_TIMEOUT = 2
+LINK_CHECK_MS = 500  # Period of the link status update while the window is idle
 SYSINIT_TIMEOUT = 25
+SYSINIT_COMMAND = 'quick_init'  # 'quick_init' keeps the stored offsets unless they drifted, 'sys_init' always tares
 MEASURE_TIMEOUT = 120
 
-SERIAL_BAUD = 115200
+SERIAL_PROTOCOL = 'binary'  # 'json' or 'binary', negotiated once the port is opened at SERIAL_BAUD
+
+DATASET_DIR = 'dataset'  # Run history kept in the storage dir, see dataset.py
+
+RAMP_DURATION_MS = 10000  # Duration of a continuous ramp sweep
+RAMP_RATE_HZ = 50         # Logging rate of a continuous ramp sweep
+
+LIVE_MAX_POINTS = 30000  # Points kept by the live plots, 10 min of ramp at RAMP_RATE_HZ
+LIVE_REDRAW_S = 0.1      # Shortest interval between two redraws of the live plots
+LIVE_MARGIN = 0.25       # Room left around the data when the live plots rescale, so they rarely have to
+
+# y, x and title of the eight plots, row by row. Throttle is in % of the output scale, for steps and ramps alike
+PLOTS = [
+    ('power', 'throttle', 'Power (w) vs Throttle % of Scale'),
+    ('power', 'rpm', 'Power (w) vs RPM'),
+    ('thrust', 'throttle', 'Thrust (kg) vs Throttle % of Scale'),
+    ('thrust', 'rpm', 'Thrust (kg) vs RPM'),
+    ('current', 'throttle', 'Current (A) vs Throttle % of Scale'),
+    ('current', 'rpm', 'Current (A) vs RPM'),
+    ('efficiency', 'throttle', 'Efficiency (kg/w) vs Throttle % of Scale'),
+    ('efficiency', 'rpm', 'Efficiency (kg/w) vs RPM')
+]
 
 DEFAULT_FONT_SIZE = sg.DEFAULT_FONT[1]
 FONT_MONO = ('Courier New', DEFAULT_FONT_SIZE)
@@ -40,6 +68,10 @@ def make_window(serial_baud ,theme=None):
         ])],
         [sg.Frame('Session Info', [
             [sg.Text('Session Name', font=FONT_MONO), sg.Push(), sg.Input(key='-NAME-', size=30)],
+            [sg.Text('Motor', font=FONT_MONO), sg.Push(), sg.Input(key='-MOTOR-', size=30)],
+            [sg.Text('Prop', font=FONT_MONO), sg.Push(), sg.Input(key='-PROP-', size=30)],
+            [sg.Text('Battery', font=FONT_MONO), sg.Push(), sg.Input(key='-BATTERY-', size=30)],
+            [sg.Text('Sweep Mode', font=FONT_MONO), sg.Push(), sg.Combo(['Step', 'Ramp'], default_value='Step', key="-MODE-", size=20, readonly=True)],
             [sg.Text('Resolution', font=FONT_MONO), sg.Push(), sg.Combo([10, 20], key="-RESOLUTION-", size=20, enable_events=True)],
             [sg.Text('Output Scaling', font=FONT_MONO), sg.Push(),
              sg.Slider(range=(0.1, 1.0), default_value=1.0, resolution=0.1, orientation='h', size=(20, 15), key='-OUTPUT SCALE-')],
@@ -62,60 +94,18 @@ def make_window(serial_baud ,theme=None):
     return window
 
 
-# Send a command to the teststand controller and wait for the response.
-def command(ser, cmd, response_type, timeout):
-    ser.write(json.dumps(cmd).encode())
-    ser.flush()
-    start_t = time.time()
-
-    while True:
-        if time.time() - start_t > timeout:
-            print('Function command() timeout!')
-            return None
-        if ser.in_waiting:
-            try:
-                result = json.loads(ser.readline().decode('utf-8').strip())
-                assert result['response_type'] == response_type
-                return result
-            except:
-                continue
-
-
 # Visualize the collected data.
 def visualize(data, measure_param):
     calculated_data = data.copy()
     calculated_data['power'] = calculated_data['voltage'] * calculated_data['current']
     calculated_data['efficiency'] = calculated_data['thrust'] / calculated_data['power']
 
-    throttle = calculated_data['throttle']
-    rpm = calculated_data['rpm']
-    power = calculated_data['power']
-    thrust = calculated_data['thrust']
-    current = calculated_data['current']
-    efficiency = calculated_data['efficiency']
-
     fig, axs = plt.subplots(4, 2, figsize=(15, 10))
     set_scale(fig.dpi / 72)
 
-    axs[0, 0].plot(throttle, power)
-    axs[0, 0].set_title('Power (w) vs Throttle %')
-    axs[0, 1].plot(rpm, power)
-    axs[0, 1].set_title('Power (w) vs RPM')
-
-    axs[1, 0].plot(throttle, thrust)
-    axs[1, 0].set_title('Thrust (kg) vs Throttle %')
-    axs[1, 1].plot(rpm, thrust)
-    axs[1, 1].set_title('Thrust (kg) vs RPM')
-
-    axs[2, 0].plot(throttle, current)
-    axs[2, 0].set_title('Current (A) vs Throttle %')
-    axs[2, 1].plot(rpm, current)
-    axs[2, 1].set_title('Current (A) vs RPM')
-
-    axs[3, 0].plot(throttle, efficiency)
-    axs[3, 0].set_title('Efficiency (kg/w) vs Throttle %')
-    axs[3, 1].plot(rpm, efficiency)
-    axs[3, 1].set_title('Efficiency (kg/w) vs RPM')
+    for ax, (y, x, title) in zip(axs.flat, PLOTS):
+        ax.plot(calculated_data[x], calculated_data[y])
+        ax.set_title(title)
 
     title = f"Motor System Performance Analysis - '{measure_param['session_name']}' | Output Scale: {measure_param['output_scale']}"
     description = "Visualization of Power, Thrust, Current, and Efficiency across Throttle and RPM Ranges"
@@ -129,6 +119,107 @@ def visualize(data, measure_param):
     plt.close(fig)
 
 
+# Live plots of a running sweep. Every streamed step is appended to preallocated arrays, and a redraw only
+# blits the lines over the cached axes; the axes are drawn again only when a point falls outside their limits.
+class LiveDashboard:
+    def __init__(self, title, on_abort):
+        self.columns = {name: np.full(LIVE_MAX_POINTS, np.nan) for name in ('throttle', 'rpm', 'power', 'thrust', 'current', 'efficiency')}
+        self.n = 0
+        self.drawn = 0
+        self.last_draw_t = 0
+        self.backgrounds = None
+
+        self.fig, axs = plt.subplots(4, 2, figsize=(15, 10))
+        self.axes = list(axs.flat)
+        self.lines = []
+        for ax, (y, x, plot_title) in zip(self.axes, PLOTS):
+            line, = ax.plot([], [], '.-', markersize=3, animated=True)
+            ax.set_title(plot_title)
+            self.lines.append(line)
+        self.fig.suptitle(f'{title}\nLive, abort or hit the safety switch on any anomaly')
+        self.fig.tight_layout(rect=[0, 0.03, 1, 0.95])
+        self.abort_button = Button(self.fig.add_axes([0.88, 0.955, 0.1, 0.035]), 'Abort', color='salmon')
+        self.abort_button.on_clicked(lambda event: on_abort())
+        self.fig.canvas.mpl_connect('draw_event', self.on_draw)
+        plt.show(block=False)
+        self.fig.canvas.draw()
+        self.fig.canvas.flush_events()
+
+    # Cache the axes without the lines after every full draw: the first one, a rescale or a resized window
+    def on_draw(self, event):
+        self.backgrounds = [self.fig.canvas.copy_from_bbox(ax.bbox) for ax in self.axes]
+        for ax, line in zip(self.axes, self.lines):
+            ax.draw_artist(line)
+
+    def add(self, step):
+        if self.n == LIVE_MAX_POINTS:
+            return
+        power = step['voltage'] * step['current']
+        values = {
+            'throttle': step['throttle'],
+            'rpm': step['rpm'],
+            'power': power,
+            'thrust': step['thrust'],
+            'current': step['current'],
+            'efficiency': step['thrust'] / power if power > 0 else np.nan
+        }
+        for name, value in values.items():
+            self.columns[name][self.n] = value
+        self.n += 1
+        if time.time() - self.last_draw_t >= LIVE_REDRAW_S:
+            self.draw()
+
+    def draw(self):
+        if self.n == self.drawn:
+            return
+        rescale = self.backgrounds == None
+        for ax, line, (y, x, _) in zip(self.axes, self.lines, PLOTS):
+            line.set_data(self.columns[x][:self.n], self.columns[y][:self.n])
+            rescale |= self.grow_limits(ax, self.columns[x][self.drawn:self.n], self.columns[y][self.drawn:self.n])
+
+        canvas = self.fig.canvas
+        if rescale:
+            canvas.draw()
+        else:
+            for ax, line, background in zip(self.axes, self.lines, self.backgrounds):
+                canvas.restore_region(background)
+                ax.draw_artist(line)
+                canvas.blit(ax.bbox)
+        canvas.flush_events()
+        self.drawn = self.n
+        self.last_draw_t = time.time()
+
+    # Draw the points still held back by LIVE_REDRAW_S and handle the clicks, while no step is coming in
+    def poll(self):
+        if self.n > self.drawn and time.time() - self.last_draw_t >= LIVE_REDRAW_S:
+            self.draw()
+        else:
+            self.fig.canvas.flush_events()
+
+    # Widen the limits of ax to the new points, with some margin, return True if they changed.
+    def grow_limits(self, ax, xs, ys):
+        changed = False
+        for values, get_lim, set_lim in ((xs, ax.get_xlim, ax.set_xlim), (ys, ax.get_ylim, ax.set_ylim)):
+            values = values[np.isfinite(values)]
+            if len(values) == 0:
+                continue
+            if self.drawn == 0:
+                low, high = values.min(), values.max()
+            else:
+                low, high = get_lim()
+                if values.min() >= low and values.max() <= high:
+                    continue
+                low, high = min(low, values.min()), max(high, values.max())
+            margin = max(high - low, abs(high), 1e-3) * LIVE_MARGIN
+            set_lim(low - margin, high + margin)
+            changed = True
+        return changed
+
+    def close(self):
+        self.draw()
+        plt.close(self.fig)
+
+
 # Fix the window shrinking issue
 def set_scale(scale):
     root = sg.tk.Tk()
@@ -143,16 +234,32 @@ window = make_window(serial_baud=SERIAL_BAUD)
 window_state = {
     '-PORT-': None,
     '-NAME-': None,
+    '-MOTOR-': None,
+    '-PROP-': None,
+    '-BATTERY-': None,
+    '-MODE-': None,
     '-RESOLUTION-': None,
     '-OUTPUT SCALE-': None,
     '-FOLDER-': None
 }
 data = None
 measure_param = None
+controller = None  # Ping reply of the controller: its id and firmware build
+capture_dir = None
+storage_dir = None
+session = None  # Open from Connect to the exit, the controller is not reset between commands
+link_alive = False
 
 
 while True:
-    event, values = window.read()
+    event, values = window.read(timeout=LINK_CHECK_MS)
+
+
+    # Follow the heartbeat of the session.
+    if session != None and session.alive != link_alive:
+        link_alive = session.alive
+        window['-SER STAT-'].update(f'Connected to {window_state["-PORT-"]}!' if link_alive else f'Link to {window_state["-PORT-"]} lost!')
+        print(f'Serial link {window_state["-PORT-"]} {"back" if link_alive else "lost"}.')
 
 
     # Store the serial port information.
@@ -160,22 +267,31 @@ while True:
         window_state['-PORT-'] = values['-PORT-']
 
 
-    # Connect to the serial port without validation.
+    # Connect to the serial port, the controller has to answer a ping.
     if event == '-CONNECT-' and window_state['-PORT-'] != None:
         try:
-            ser = serial.Serial(window_state['-PORT-'], SERIAL_BAUD)
-            ser.write(f'Hello! First time meeting you! I\'m UAV\'s Teststand2 Buddy!'.encode())
-            ser.close()
+            session = Session(window_state['-PORT-'], SERIAL_BAUD)
+            result = session.command({'command_type': 'ping'}, 'ping', CONNECT_TIMEOUT)
+            assert result != None
         except:
+            if session != None:
+                session.close()
+                session = None
             print(f'Connecting to {window_state["-PORT-"]} failed.')
             sg.popup_ok(f'Connecting To {window_state["-PORT-"]} Failed.', font=FONT_MONO)
             continue
 
+        controller = result
+        session.on_message = lambda message: print(f'Controller: {message}')
+        if SERIAL_PROTOCOL == 'binary':
+            session.set_protocol('binary', FAST_SERIAL_BAUD)
+        link_alive = True
+
         window['-CONNECT-'].update(disabled=True)
         window['-PORT-'].update(disabled=True)
         window['-SER STAT-'].update(f'Connected to {window_state["-PORT-"]}!')
         window['-LOCK-'].update(disabled=False)
-        print(f'Serial connection {window_state["-PORT-"]} ok!')
+        print(f'Serial connection {window_state["-PORT-"]} ok! (controller {result.get("controller_id")}, firmware {result.get("firmware")}, {session.protocol})')
         sg.popup_ok(f'Serial Connection {window_state["-PORT-"]} OK!', font=FONT_MONO)
 
 
@@ -183,18 +299,26 @@ while True:
     if event == '-LOCK-':
         try:
             window_state['-NAME-'] = values['-NAME-']
+            window_state['-MOTOR-'] = values['-MOTOR-']
+            window_state['-PROP-'] = values['-PROP-']
+            window_state['-BATTERY-'] = values['-BATTERY-']
+            window_state['-MODE-'] = values['-MODE-']
             window_state['-RESOLUTION-'] = values['-RESOLUTION-']
             window_state['-OUTPUT SCALE-'] = values['-OUTPUT SCALE-']
             window_state['-FOLDER-'] = values['-FOLDER-']
             assert window_state['-NAME-'] != None
             assert window_state['-NAME-'] != ''
-            assert window_state['-RESOLUTION-'] != None
+            assert window_state['-MODE-'] == 'Ramp' or window_state['-RESOLUTION-'] != None
             assert os.path.exists(window_state['-FOLDER-'])
         except:
             print('Failed to lock the session information!')
             sg.popup_ok('Failed to Lock the Session Information!', font=FONT_MONO)
             continue
     
+        window['-MOTOR-'].update(disabled=True)
+        window['-PROP-'].update(disabled=True)
+        window['-BATTERY-'].update(disabled=True)
+        window['-MODE-'].update(disabled=True)
         window['-RESOLUTION-'].update(disabled=True)
         window['-OUTPUT SCALE-'].update(disabled=True)
         window['-FOLDER-'].update(disabled=True)
@@ -218,12 +342,10 @@ while True:
         if sg.popup(*m, custom_text='Sys Init', font=FONT_MONO, title='Blank Warning') == None:
             continue
 
-        ser = serial.Serial(window_state['-PORT-'], SERIAL_BAUD)
         cmd = {
-            'command_type': 'sys_init',
+            'command_type': SYSINIT_COMMAND,
         }
-        result = command(ser, cmd, 'sys_init', SYSINIT_TIMEOUT)
-        ser.close()
+        result = session.command(cmd, SYSINIT_COMMAND, SYSINIT_TIMEOUT)
 
         if result == None:
             print('System initialization timeout!')
@@ -236,8 +358,9 @@ while True:
             print('System initialized!')
             sg.popup_ok('System Initialized!', font=FONT_MONO)
         else:
-            print('System initialization failed!')
-            sg.popup_ok('System Initialization Failed!', font=FONT_MONO)
+            faults = ', '.join(result.get('faults', []))
+            print(f'System initialization failed! ({faults})')
+            sg.popup_ok('System Initialization Failed!', f'Failed checks: {faults}', font=FONT_MONO)
             continue
 
 
@@ -253,35 +376,83 @@ while True:
         if sg.popup(*m, custom_text='Measure', font=FONT_MONO, title='Blank Warning') == None:
             continue
 
-        ser = serial.Serial(window_state['-PORT-'], SERIAL_BAUD)
-        cmd = {
-            'command_type': 'measure',
-            'steps': window_state['-RESOLUTION-'],
-            'throttle_scale': window_state['-OUTPUT SCALE-']
-        }
-        result = command(ser, cmd, 'measure', MEASURE_TIMEOUT)
-        ser.close()
+        if window_state['-MODE-'] == 'Ramp':
+            response_type = 'ramp'
+            cmd = {
+                'command_type': 'ramp',
+                'throttle_scale': window_state['-OUTPUT SCALE-'],
+                'duration_ms': RAMP_DURATION_MS,
+                'rate_hz': RAMP_RATE_HZ
+            }
+        else:
+            response_type = 'measure'
+            cmd = {
+                'command_type': 'measure',
+                'steps': window_state['-RESOLUTION-'],
+                'throttle_scale': window_state['-OUTPUT SCALE-'],
+                'stream': True
+            }
 
+        title = f"'{window_state['-NAME-']}' | Output Scale: {window_state['-OUTPUT SCALE-']}"
+        dashboard = LiveDashboard(title, on_abort=lambda: session.control({'command_type': 'abort'}))
+
+        def show_step(record):
+            dashboard.add(record['data'])
+            if response_type == 'ramp':
+                if record['seq'] % RAMP_RATE_HZ == 0:
+                    window['-SESSION STAT-'].update(f'Ramping, Throttle {record["data"]["throttle"]:.0f}%...')
+                    window.refresh()
+                return
+            print(f'Step {record["seq"]}: {record["data"]}')
+            window['-SESSION STAT-'].update(f'Measuring Step {record["seq"]}/{window_state["-RESOLUTION-"]}...')
+            window.refresh()
+
+        # The Abort button is serviced between the steps as well, a stalled stand can still be aborted
+        result = session.command(cmd, response_type, MEASURE_TIMEOUT, on_record=show_step, on_idle=dashboard.poll)
+        dashboard.close()
         if result == None:
             print('Measurement timeout!')
             sg.popup_ok('Measurement Timeout!', font=FONT_MONO)
             continue
-        if result['ok'] == True:
-            data = pd.DataFrame(result['data'])
-            measure_param = {
-                'session_name': window_state['-NAME-'],
-                'output_scale': window_state['-OUTPUT SCALE-']
-            }
-            visualize(data, measure_param)
 
-            window['-MEASURE-'].update(disabled=True)
+        # One storage dir per run, named when it ends: the trip capture goes inside it
+        storage_dir = f'{window_state["-FOLDER-"]}/{window_state["-NAME-"]}_{datetime.now().strftime("%y%m%d-%H%M")}'
+        # Keep the raw samples around a safety trip for the post-mortem
+        if 'trip' in result and session.protocol == 'binary':
+            capture_dir = f'{storage_dir}/capture'
+            if session.dump_capture(capture_dir) != None:
+                print(f'Capture around the trip saved to {capture_dir}')
+            else:
+                capture_dir = None
+
+        data = pd.json_normalize(result.get('data', []))  # Nested 'stats' become 'stats.<channel>.<stat>' columns
+        measure_param = {
+            'session_name': window_state['-NAME-'],
+            'output_scale': window_state['-OUTPUT SCALE-'],
+            'motor': window_state['-MOTOR-'],
+            'prop': window_state['-PROP-'],
+            'battery': window_state['-BATTERY-'],
+            'mode': window_state['-MODE-'],
+            'firmware': controller.get('firmware'),
+            'controller_id': controller.get('controller_id'),
+            'date': datetime.now().isoformat(timespec='seconds'),
+            'ok': result['ok'],
+            'error': result.get('error'),
+            'trip': result['trip']['reason'] if 'trip' in result else None,
+            'capture': capture_dir
+        }
+        window['-MEASURE-'].update(disabled=True)  # Lock the gui to prevent the user from taking another measurement.
+        window['-SAVE N EXIT-'].update(disabled=False)  # Failed and tripped runs are kept as well
+        if len(data) > 0:
+            visualize(data, measure_param)
             window['-VISUALIZE-'].update(disabled=False)
-            window['-SAVE N EXIT-'].update(disabled=False)
+
+        if result['ok'] == True:
             window['-SESSION STAT-'].update('Measurement Done!')
             print('The measurement was completed flawlessly :D')
             sg.popup_ok('The Measurement Was Completed Flawlessly :D', font=FONT_MONO)
         else:
-            window['-MEASURE-'].update(disabled=True)  # Lock the gui to prevent the user from taking another measurement.
+            window['-SESSION STAT-'].update(f'Measurement Failed! ({measure_param["trip"] or measure_param["error"]})')
             print(result)
             print('Measurement failed!')
             sg.popup_ok('Measurement Failed!', font=FONT_MONO)
@@ -295,12 +466,14 @@ while True:
 
     # Save the collected data and exit.
     if event == '-SAVE N EXIT-':
-        storage_dir = f'{window_state["-FOLDER-"]}/{window_state["-NAME-"]}_{datetime.now().strftime("%y%m%d-%H%M")}'
         os.makedirs(storage_dir, exist_ok=True)
         with open(f'{storage_dir}/measure_param.json', 'w') as f:
             json.dump(measure_param, f, indent=4)
         data.to_csv(f'{storage_dir}/data.csv', index=False)
-        shutil.copy2('./temp/visualized.png', f'{storage_dir}/visualized.png')
+        if len(data) > 0:
+            shutil.copy2('./temp/visualized.png', f'{storage_dir}/visualized.png')
+        run_id = add_run(f'{window_state["-FOLDER-"]}/{DATASET_DIR}', measure_param, data, capture_dir)
+        print(f'Run {run_id} added to {window_state["-FOLDER-"]}/{DATASET_DIR}')
         break
 
 
@@ -321,7 +494,5 @@ while True:
 
 
 window.close()
-try:
-    ser.close()
-except:
-    pass
\ No newline at end of file
+if session != None:
+    session.close()
\ No newline at end of file
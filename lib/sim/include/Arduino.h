@@ -0,0 +1,85 @@
+// Arduino core API of the native build, backed by the simulated stand (sim.h)
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+#include "freertos/FreeRTOS.h"
+
+#define IRAM_ATTR
+#define HIGH         0x1
+#define LOW          0x0
+#define INPUT        0x01
+#define OUTPUT       0x03
+#define INPUT_PULLUP 0x05
+#define RISING       0x01
+#define FALLING      0x02
+#define CHANGE       0x03
+#define PI           3.1415926535897932384626433832795
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+using std::min;
+using std::max;
+
+template <typename T> T constrain(T x, T low, T high) { return x < low ? low : (x > high ? high : x); }
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+uint16_t analogRead(uint8_t pin);
+
+#define digitalPinToInterrupt(p) (p)
+void attachInterrupt(uint8_t pin, void (*isr)(), int mode);
+void detachInterrupt(uint8_t pin);
+
+bool psramFound();
+
+class EspClass {
+public:
+    uint64_t getEfuseMac();  // SIM_MAC
+};
+
+extern EspClass ESP;
+
+// Hardware timers, divider of the 80 MHz APB clock
+typedef struct hw_timer_s hw_timer_t;
+hw_timer_t *timerBegin(uint8_t num, uint16_t divider, bool count_up);
+void timerAttachInterrupt(hw_timer_t *timer, void (*isr)(), bool edge);
+void timerAlarmWrite(hw_timer_t *timer, uint64_t alarm_value, bool autoreload);
+void timerAlarmEnable(hw_timer_t *timer);
+void timerAlarmDisable(hw_timer_t *timer);
+void timerRestart(hw_timer_t *timer);
+
+// LEDC, the channel driving SIM_ESC_COMMAND_PIN is the ESC input
+double ledcSetup(uint8_t channel, double freq, uint8_t resolution_bits);
+void ledcAttachPin(uint8_t pin, uint8_t channel);
+void ledcWrite(uint8_t channel, uint32_t duty);
+
+// UART0, the host link: stdin / stdout or a TCP client (sim.h)
+class HardwareSerial {
+public:
+    void begin(unsigned long baud);
+    void updateBaudRate(unsigned long baud);
+    int available();
+    int read();
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buffer, size_t size);
+    size_t print(const char *s);
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    void flush();
+
+private:
+    unsigned long baud_ = 115200;
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,21 @@
+// HX711 library of the native build: only the calibration is kept here, the firmware clocks the
+// simulated converter through the pins itself
+#pragma once
+#include <stdint.h>
+
+class HX711 {
+public:
+    void begin(uint8_t dout, uint8_t pd_sck, uint8_t gain = 128) {
+        (void)dout;
+        (void)pd_sck;
+        (void)gain;
+    }
+    void set_scale(float scale = 1.f) { scale_ = scale; }
+    float get_scale() { return scale_; }
+    void set_offset(long offset = 0) { offset_ = offset; }
+    long get_offset() { return offset_; }
+
+private:
+    float scale_ = 1.f;
+    long offset_ = 0;
+};
@@ -0,0 +1,17 @@
+// NVS of the native build, kept in memory: every boot of the simulator starts uncalibrated
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+class Preferences {
+public:
+    bool begin(const char *name, bool read_only = false);
+    void end();
+    uint32_t getUInt(const char *key, uint32_t default_value = 0);
+    size_t putUInt(const char *key, uint32_t value);
+    size_t getBytes(const char *key, void *buf, size_t len);
+    size_t putBytes(const char *key, const void *value, size_t len);
+
+private:
+    const char *name_ = nullptr;
+};
@@ -0,0 +1,11 @@
+// Heap of the native build, sized like the module by SIM_HEAP, PSRAM only with SIM_PSRAM
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT   (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+size_t heap_caps_get_free_size(uint32_t caps);
+void *heap_caps_malloc(size_t size, uint32_t caps);
@@ -0,0 +1,32 @@
+// FreeRTOS API of the native build: tasks are threads, every critical section takes one lock
+#pragma once
+#include <stdint.h>
+
+typedef void *TaskHandle_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef struct { int unused; } portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define pdTRUE                       1
+#define pdFALSE                      0
+#define pdPASS                       1
+#define portMAX_DELAY                0xffffffffUL
+#define portTICK_PERIOD_MS           1
+#define pdMS_TO_TICKS(ms)            ((TickType_t)(ms))
+#define configMAX_PRIORITIES         25
+
+// Interrupts run on their own thread, there is no context switch to ask for
+#define portYIELD_FROM_ISR(...) ((void)0)
+
+void portENTER_CRITICAL(portMUX_TYPE *mux);
+void portEXIT_CRITICAL(portMUX_TYPE *mux);
+void vTaskSuspendAll();
+BaseType_t xTaskResumeAll();
+
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void *), const char *name, uint32_t stack_depth, void *param,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+void vTaskDelay(TickType_t ticks);
@@ -0,0 +1,9 @@
+// Ring buffers of the native build, only the RMT receiver hands them out and it never receives anything
+#pragma once
+#include <stddef.h>
+#include "FreeRTOS.h"
+
+typedef void *RingbufHandle_t;
+
+void *xRingbufferReceive(RingbufHandle_t buffer, size_t *size, TickType_t ticks);
+void vRingbufferReturnItem(RingbufHandle_t buffer, void *item);
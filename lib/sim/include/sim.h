@@ -0,0 +1,98 @@
+// Simulated teststand of the native build: the motor, the sensors and the host link behind the Arduino API.
+//
+// The firmware runs unchanged on the host. FreeRTOS tasks and hardware timers are threads, the ESC output drives
+// a first order motor model whose thrust, current, voltage and rpm are read back through the same HX711,
+// ADC and IR sensor pins as on the stand. Every parameter of the model can be set through the environment:
+//
+//   SIM_RPM_MAX          RPM at full throttle                           (9000)
+//   SIM_TAU_MS           Time constant of the rpm response              (120)
+//   SIM_THRUST_MAX       Thrust at full throttle, kg                    (1.6)
+//   SIM_CURRENT_MAX      Current at full throttle, A                    (28)
+//   SIM_CURRENT_IDLE     Current of the spinning motor at no load, A    (0.3)
+//   SIM_BATTERY_V        Open circuit battery voltage, V                (16.4)
+//   SIM_BATTERY_R        Internal resistance of the battery, Ohm        (0.03)
+//   SIM_BLADES           Blades of the propeller                        (2)
+//   SIM_VIBRATION        Blade pass vibration on the load cell, kg      (0.02)
+//   SIM_THRUST_NOISE     Noise of the load cell, kg                     (0.005)
+//   SIM_CURRENT_NOISE    Noise of the current sensor, A                 (0.2)
+//   SIM_VOLTAGE_NOISE    Noise of the battery voltage, V                (0.02)
+//   SIM_RPM_JITTER       Relative jitter of the IR sensor edges         (0.005)
+//   SIM_SWITCH_MS        Press the safety switch this long after boot, 0 never (0)
+//   SIM_PSRAM            1 to simulate a module with PSRAM              (0)
+//   SIM_HEAP             Free internal heap, bytes                      (160000)
+//   SIM_SEED             Seed of the noise                              (1)
+//   SIM_MAC              Factory MAC, in hex, of the simulated module   (SIM_DEFAULT_MAC + SIM_SERIAL_PORT)
+//   SIM_SERIAL_PORT      Serve the serial port on this TCP port (socket://localhost:port), 0 uses stdin / stdout (0)
+//   SIM_UART_PACE        1 paces the serial output at the baud rate like the UART does (1)
+//   SIM_FUZZ             Feed this many mutated commands instead of reading the host, then exit (0)
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Wiring of the stand, as main.cpp defines it
+#define SIM_SAFETY_SWITCH_PIN 15
+#define SIM_RPM_DOUT_PIN      33
+#define SIM_THRUST_DT_PIN     27
+#define SIM_THRUST_SCK_PIN    26
+#define SIM_CURRENT_AOUT_PIN  25
+#define SIM_BAT_VOLTAGE_PIN   32
+#define SIM_ESC_COMMAND_PIN   13
+
+// Sensors, matching the default calibration of the firmware
+#define SIM_CURRENT_SCALE     55.735     // A / V at the ADC pin
+#define SIM_CURRENT_BIAS_MV   12.0       // Output of the current amplifier at 0 A
+#define SIM_VOLTAGE_SCALE     7.6585     // Battery V / V at the ADC pin
+#define SIM_THRUST_SCALE      117105.75  // HX711 counts / kg
+#define SIM_THRUST_OFFSET     -42000     // HX711 counts of the unloaded cell
+#define SIM_HX711_RATE_HZ     80
+#define SIM_ADC_MV            3300.0     // Linear ADC: 4095 at 3.3 V
+#define SIM_ESC_DEADBAND      0.02       // The motor stops below this throttle
+#define SIM_MIN_RPM           60.0       // No IR edges below this
+#define SIM_DEFAULT_MAC       0x103A9C60A124ULL
+
+struct SimConfig {
+    float rpm_max = 9000.0;
+    float tau_ms = 120.0;
+    float thrust_max = 1.6;
+    float current_max = 28.0;
+    float current_idle = 0.3;
+    float battery_v = 16.4;
+    float battery_r = 0.03;
+    int blades = 2;
+    float vibration = 0.02;
+    float thrust_noise = 0.005;
+    float current_noise = 0.2;
+    float voltage_noise = 0.02;
+    float rpm_jitter = 0.005;
+    uint32_t switch_ms = 0;
+    bool psram = false;
+    size_t heap = 160000;
+    uint32_t seed = 1;
+    uint64_t mac = SIM_DEFAULT_MAC;
+    int serial_port = 0;
+    bool uart_pace = true;
+    uint32_t fuzz = 0;
+};
+
+extern SimConfig sim_config;
+
+// Boot: read the config and start the sensor and host link threads, before setup()
+void sim_config_load();
+void sim_plant_begin();
+void sim_serial_begin();
+
+// Plant, all of them advance the model to now
+void sim_esc_pulse(float pulse_us, double freq_hz);  // ESC input, a pulse every 1 / freq_hz
+float sim_current_a();
+float sim_voltage_v();
+float sim_thrust_kg();
+
+// Pins read and driven by the plant
+int sim_hx711_dout();
+void sim_hx711_clock(int level);
+int sim_switch_level();
+void sim_interrupt(uint8_t pin);  // Run the interrupt attached to pin, if enabled
+
+// Critical sections and scheduler suspension, one lock for all of them
+void sim_lock();
+void sim_unlock();
@@ -0,0 +1,510 @@
+// Arduino core, ESP-IDF drivers and the host link of the native build, and its main()
+#include "Arduino.h"
+#include "Preferences.h"
+#include "driver/gpio.h"
+#include "driver/rmt.h"
+#include "esp_adc_cal.h"
+#include "esp_heap_caps.h"
+#include "sim.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <stdarg.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+void setup();
+void loop();
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+const Clock::time_point boot = Clock::now();
+
+struct Pin {
+    uint8_t level = HIGH;
+    void (*isr)() = nullptr;
+    std::atomic<bool> enabled{true};
+};
+
+Pin pins[GPIO_NUM_MAX];
+
+struct LedcChannel {
+    double freq = 0;
+    uint8_t bits = 8;
+    int pin = -1;
+};
+
+LedcChannel ledc[16];
+
+}  // namespace
+
+//
+// Time
+//
+
+unsigned long micros() {
+    return static_cast<unsigned long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - boot).count());
+}
+
+unsigned long millis() { return micros() / 1000; }
+
+void delay(uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+void delayMicroseconds(uint32_t us) {
+    // Spun like the ROM delay: the HX711 clock pulses are shorter than the sleep granularity of the host
+    Clock::time_point until = Clock::now() + std::chrono::microseconds(us);
+    while (Clock::now() < until) {
+    }
+}
+
+//
+// GPIO
+//
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    (void)pin;
+    (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+    if (pin == SIM_THRUST_SCK_PIN) sim_hx711_clock(val);
+    if (pin < GPIO_NUM_MAX) pins[pin].level = val;
+}
+
+int digitalRead(uint8_t pin) {
+    if (pin == SIM_THRUST_DT_PIN) return sim_hx711_dout();
+    if (pin == SIM_SAFETY_SWITCH_PIN) return sim_switch_level();
+    return pin < GPIO_NUM_MAX ? pins[pin].level : LOW;
+}
+
+void attachInterrupt(uint8_t pin, void (*isr)(), int mode) {
+    (void)mode;
+    if (pin < GPIO_NUM_MAX) pins[pin].isr = isr;
+}
+
+void detachInterrupt(uint8_t pin) {
+    if (pin < GPIO_NUM_MAX) pins[pin].isr = nullptr;
+}
+
+void sim_interrupt(uint8_t pin) {
+    if (pin < GPIO_NUM_MAX && pins[pin].isr != nullptr && pins[pin].enabled) pins[pin].isr();
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t pin) {
+    pins[pin].enabled = true;
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_disable(gpio_num_t pin) {
+    pins[pin].enabled = false;
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t pin, gpio_mode_t mode) {
+    (void)pin;
+    (void)mode;
+    return ESP_OK;
+}
+
+esp_err_t gpio_pullup_en(gpio_num_t pin) {
+    (void)pin;
+    return ESP_OK;
+}
+
+//
+// ADC
+//
+
+uint16_t analogRead(uint8_t pin) {
+    float mv = 0;
+    if (pin == SIM_CURRENT_AOUT_PIN) mv = SIM_CURRENT_BIAS_MV + sim_current_a() / SIM_CURRENT_SCALE * 1000.0;
+    else if (pin == SIM_BAT_VOLTAGE_PIN) mv = sim_voltage_v() / SIM_VOLTAGE_SCALE * 1000.0;
+    return static_cast<uint16_t>(constrain(lroundf(mv / SIM_ADC_MV * 4095.0), 0L, 4095L));
+}
+
+esp_adc_cal_value_t esp_adc_cal_characterize(adc_unit_t unit, adc_atten_t atten, adc_bits_width_t width,
+                                             uint32_t default_vref, esp_adc_cal_characteristics_t *chars) {
+    (void)unit;
+    (void)atten;
+    (void)width;
+    chars->vref = default_vref;
+    return ESP_ADC_CAL_VAL_DEFAULT_VREF;
+}
+
+uint32_t esp_adc_cal_raw_to_voltage(uint32_t raw, const esp_adc_cal_characteristics_t *chars) {
+    (void)chars;
+    return static_cast<uint32_t>(lround(raw * SIM_ADC_MV / 4095.0));
+}
+
+//
+// LEDC
+//
+
+double ledcSetup(uint8_t channel, double freq, uint8_t resolution_bits) {
+    ledc[channel].freq = freq;
+    ledc[channel].bits = resolution_bits;
+    return freq;
+}
+
+void ledcAttachPin(uint8_t pin, uint8_t channel) { ledc[channel].pin = pin; }
+
+void ledcWrite(uint8_t channel, uint32_t duty) {
+    const LedcChannel &output = ledc[channel];
+    if (output.pin != SIM_ESC_COMMAND_PIN || output.freq <= 0) return;
+    double pulse_us = static_cast<double>(duty) / (1UL << output.bits) * 1000000.0 / output.freq;
+    sim_esc_pulse(pulse_us, output.freq);
+}
+
+//
+// RMT, DShot is not simulated
+//
+
+rmt_config_t RMT_DEFAULT_CONFIG_TX(gpio_num_t pin, rmt_channel_t channel) {
+    rmt_config_t config = {};
+    config.rmt_mode = RMT_MODE_TX;
+    config.channel = channel;
+    config.gpio_num = pin;
+    return config;
+}
+
+rmt_config_t RMT_DEFAULT_CONFIG_RX(gpio_num_t pin, rmt_channel_t channel) {
+    rmt_config_t config = RMT_DEFAULT_CONFIG_TX(pin, channel);
+    config.rmt_mode = RMT_MODE_RX;
+    return config;
+}
+
+esp_err_t rmt_config(const rmt_config_t *config) {
+    (void)config;
+    return ESP_OK;
+}
+
+esp_err_t rmt_driver_install(rmt_channel_t channel, size_t rx_buf_size, int intr_alloc_flags) {
+    (void)channel;
+    (void)rx_buf_size;
+    (void)intr_alloc_flags;
+    return ESP_OK;
+}
+
+esp_err_t rmt_write_items(rmt_channel_t channel, const rmt_item32_t *items, int item_num, bool wait_tx_done) {
+    (void)channel;
+    (void)items;
+    (void)item_num;
+    (void)wait_tx_done;
+    return ESP_OK;
+}
+
+esp_err_t rmt_rx_start(rmt_channel_t channel, bool rx_idx_rst) {
+    (void)channel;
+    (void)rx_idx_rst;
+    return ESP_OK;
+}
+
+esp_err_t rmt_rx_stop(rmt_channel_t channel) {
+    (void)channel;
+    return ESP_OK;
+}
+
+esp_err_t rmt_get_ringbuf_handle(rmt_channel_t channel, RingbufHandle_t *buffer) {
+    (void)channel;
+    *buffer = nullptr;
+    return ESP_OK;
+}
+
+void *xRingbufferReceive(RingbufHandle_t buffer, size_t *size, TickType_t ticks) {
+    (void)buffer;
+    (void)ticks;
+    *size = 0;
+    return nullptr;
+}
+
+void vRingbufferReturnItem(RingbufHandle_t buffer, void *item) {
+    (void)buffer;
+    (void)item;
+}
+
+//
+// Heap
+//
+
+namespace {
+
+std::mutex heap_mutex;
+size_t heap_used = 0;
+size_t psram_used = 0;
+
+const size_t PSRAM_SIZE = 4 * 1024 * 1024;
+
+size_t heap_free(uint32_t caps) {
+    if (caps & MALLOC_CAP_SPIRAM) return sim_config.psram ? PSRAM_SIZE - psram_used : 0;
+    return sim_config.heap > heap_used ? sim_config.heap - heap_used : 0;
+}
+
+}  // namespace
+
+bool psramFound() { return sim_config.psram; }
+
+EspClass ESP;
+
+uint64_t EspClass::getEfuseMac() { return sim_config.mac; }
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    std::lock_guard<std::mutex> lock(heap_mutex);
+    return heap_free(caps);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+    std::lock_guard<std::mutex> lock(heap_mutex);
+    return heap_free(caps);
+}
+
+// Allocations are never freed by the firmware, only their size is accounted for
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    std::lock_guard<std::mutex> lock(heap_mutex);
+    if (size > heap_free(caps)) return nullptr;
+    (caps & MALLOC_CAP_SPIRAM ? psram_used : heap_used) += size;
+    return malloc(size);
+}
+
+//
+// Preferences
+//
+
+namespace {
+
+std::mutex nvs_mutex;
+std::map<std::string, std::vector<uint8_t>> nvs;
+
+std::string nvs_key(const char *name, const char *key) { return std::string(name) + "/" + key; }
+
+}  // namespace
+
+bool Preferences::begin(const char *name, bool read_only) {
+    (void)read_only;
+    name_ = name;
+    return true;
+}
+
+void Preferences::end() { name_ = nullptr; }
+
+uint32_t Preferences::getUInt(const char *key, uint32_t default_value) {
+    uint32_t value = default_value;
+    getBytes(key, &value, sizeof(value));
+    return value;
+}
+
+size_t Preferences::putUInt(const char *key, uint32_t value) { return putBytes(key, &value, sizeof(value)); }
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t len) {
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    auto entry = nvs.find(nvs_key(name_, key));
+    if (entry == nvs.end() || entry->second.size() > len) return 0;
+    memcpy(buf, entry->second.data(), entry->second.size());
+    return entry->second.size();
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len) {
+    std::lock_guard<std::mutex> lock(nvs_mutex);
+    const uint8_t *bytes = static_cast<const uint8_t *>(value);
+    nvs[nvs_key(name_, key)] = std::vector<uint8_t>(bytes, bytes + len);
+    return len;
+}
+
+//
+// Serial
+//
+
+HardwareSerial Serial;
+
+namespace {
+
+std::mutex rx_mutex;
+std::deque<uint8_t> rx;
+std::mutex tx_mutex;
+std::atomic<int> tx_fd{STDOUT_FILENO};
+Clock::time_point line_free;  // End of the bytes still on the wire when paced
+
+void rx_push(const uint8_t *data, size_t len) {
+    std::lock_guard<std::mutex> lock(rx_mutex);
+    rx.insert(rx.end(), data, data + len);
+}
+
+bool rx_empty() {
+    std::lock_guard<std::mutex> lock(rx_mutex);
+    return rx.empty();
+}
+
+void stdin_reader() {
+    uint8_t buf[256];
+    ssize_t n;
+    while ((n = ::read(STDIN_FILENO, buf, sizeof(buf))) > 0) rx_push(buf, n);
+    // The host went away: let the last responses out, then stop like a disconnected stand
+    delay(1000);
+    exit(0);
+}
+
+// One host at a time, the next one is accepted once it disconnects
+void tcp_server(int port) {
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(server, 1) != 0) {
+        fprintf(stderr, "sim: cannot listen on port %d\n", port);
+        exit(1);
+    }
+    fprintf(stderr, "sim: serial port on socket://localhost:%d\n", port);
+    while (true) {
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0) continue;
+        tx_fd = client;
+        uint8_t buf[256];
+        ssize_t n;
+        while ((n = ::read(client, buf, sizeof(buf))) > 0) rx_push(buf, n);
+        tx_fd = -1;
+        close(client);
+    }
+}
+
+const char *fuzz_seeds[] = {
+    "{\"command_type\": \"sys_init\"}",
+    "{\"command_type\": \"ping\"}",
+    "{\"command_type\": \"quick_init\"}",
+    "{\"command_type\": \"measure\", \"steps\": 4, \"throttle_scale\": 0.3, \"stream\": true}",
+    "{\"command_type\": \"measure\", \"profile\": \"levels\", \"levels\": [0.1, 0.2], \"hold_ms\": 200}",
+    "{\"command_type\": \"ramp\", \"throttle_scale\": 0.2, \"duration_ms\": 500}",
+    "{\"command_type\": \"pause\"}",
+    "{\"command_type\": \"resume\"}",
+    "{\"command_type\": \"stop\"}",
+    "{\"command_type\": \"tare\"}",
+    "{\"command_type\": \"stats\", \"reset\": true}",
+    "{\"command_type\": \"set_capture\", \"post_ms\": 100}",
+    "{\"command_type\": \"set_protocol\", \"protocol\": \"binary\"}",
+    "{\"command_type\": \"set_protocol\", \"protocol\": \"json\"}",
+};
+
+// Mutate seed commands, byte flips, inserts, deletes, truncations and repeats, and feed them as host input
+void fuzzer(uint32_t count) {
+    std::mt19937 rng(sim_config.seed);
+    const size_t n_seeds = sizeof(fuzz_seeds) / sizeof(fuzz_seeds[0]);
+    for (uint32_t i = 0; i < count; i++) {
+        std::string input = fuzz_seeds[rng() % n_seeds];
+        for (uint32_t mutations = rng() % 4; mutations > 0 && !input.empty(); mutations--) {
+            size_t at = rng() % input.size();
+            switch (rng() % 5) {
+            case 0: input[at] = static_cast<char>(rng()); break;
+            case 1: input.insert(at, 1, static_cast<char>(rng())); break;
+            case 2: input.erase(at, 1); break;
+            case 3: input.resize(at); break;
+            case 4: input.insert(at, input.substr(at, rng() % 64)); break;
+            }
+        }
+        if (rng() % 8 != 0) input += '\n';
+        rx_push(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+        // The firmware reads the link between the other tasks, give it the time to
+        while (!rx_empty()) delay(1);
+        if ((i + 1) % 1000 == 0) fprintf(stderr, "sim: fuzz %u / %u\n", i + 1, count);
+    }
+    delay(1000);
+    fprintf(stderr, "sim: fuzz done, %u inputs\n", count);
+    exit(0);
+}
+
+}  // namespace
+
+void sim_serial_begin() {
+    if (sim_config.fuzz > 0) {
+        tx_fd = -1;
+        std::thread(fuzzer, sim_config.fuzz).detach();
+    } else if (sim_config.serial_port > 0) {
+        tx_fd = -1;
+        std::thread(tcp_server, sim_config.serial_port).detach();
+    } else {
+        std::thread(stdin_reader).detach();
+    }
+}
+
+void HardwareSerial::begin(unsigned long baud) { baud_ = baud; }
+
+void HardwareSerial::updateBaudRate(unsigned long baud) { baud_ = baud; }
+
+int HardwareSerial::available() {
+    std::lock_guard<std::mutex> lock(rx_mutex);
+    return static_cast<int>(rx.size());
+}
+
+int HardwareSerial::read() {
+    std::lock_guard<std::mutex> lock(rx_mutex);
+    if (rx.empty()) return -1;
+    uint8_t c = rx.front();
+    rx.pop_front();
+    return c;
+}
+
+size_t HardwareSerial::write(uint8_t c) { return write(&c, 1); }
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    if (sim_config.uart_pace) {
+        // 10 bits a byte, the writer waits for the wire like it waits for the full UART FIFO
+        Clock::time_point now = Clock::now();
+        if (line_free < now) line_free = now;
+        line_free += std::chrono::nanoseconds(size * 10000000000ULL / baud_);
+        std::this_thread::sleep_until(line_free);
+    }
+    int fd = tx_fd;
+    if (fd >= 0) {
+        for (size_t sent = 0; sent < size;) {
+            ssize_t n = fd == STDOUT_FILENO ? ::write(fd, buffer + sent, size - sent)
+                                            : ::send(fd, buffer + sent, size - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
+        }
+    }
+    return size;
+}
+
+size_t HardwareSerial::print(const char *s) { return write(reinterpret_cast<const uint8_t *>(s), strlen(s)); }
+
+size_t HardwareSerial::printf(const char *format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (len < 0) return 0;
+    return write(reinterpret_cast<const uint8_t *>(buf), min(static_cast<size_t>(len), sizeof(buf) - 1));
+}
+
+void HardwareSerial::flush() {
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    if (sim_config.uart_pace) std::this_thread::sleep_until(line_free);
+}
+
+//
+// Main
+//
+
+int main() {
+    sim_config_load();
+    sim_plant_begin();
+    sim_serial_begin();
+    setup();
+    while (true) {
+        loop();
+        std::this_thread::yield();
+    }
+}
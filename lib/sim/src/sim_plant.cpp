@@ -0,0 +1,223 @@
+// Motor, propeller and sensors of the simulated stand
+#include "Arduino.h"
+#include "sim.h"
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <thread>
+
+SimConfig sim_config;
+
+namespace {
+
+struct EscRange {
+    double freq_hz;
+    float min_us;
+    float max_us;
+};
+
+// Throttle range of the ESC, calibrated to the pulses of the firmware for every LEDC protocol
+const EscRange esc_ranges[] = {
+    {50, 1100.0, 1940.0},
+    {2000, 137.5, 242.5},
+    {8000, 7.0, 23.8},
+};
+
+struct Plant {
+    std::mutex mutex;
+    float throttle = 0;
+    float rpm = 0;
+    double blade_phase = 0;  // rad
+    uint32_t last_us = 0;
+    std::mt19937 rng;
+    std::normal_distribution<float> gauss{0.0, 1.0};
+};
+
+Plant plant;
+
+struct Hx711 {
+    std::mutex mutex;
+    bool ready = false;
+    int32_t word = 0;     // Latest conversion
+    int32_t shifted = 0;  // Conversion being clocked out
+    int pulses = 0;
+    int dout = HIGH;
+};
+
+Hx711 hx711;
+volatile int switch_level = HIGH;
+
+float env_float(const char *name, float fallback) {
+    const char *value = getenv(name);
+    return value != nullptr ? static_cast<float>(atof(value)) : fallback;
+}
+
+uint32_t env_uint(const char *name, uint32_t fallback) {
+    const char *value = getenv(name);
+    return value != nullptr ? static_cast<uint32_t>(strtoul(value, nullptr, 10)) : fallback;
+}
+
+// Advance the motor to now, the plant lock is held
+void plant_advance() {
+    uint32_t now_us = micros();
+    float dt = (now_us - plant.last_us) / 1000000.0;
+    plant.last_us = now_us;
+    float target = plant.throttle > SIM_ESC_DEADBAND ? plant.throttle * sim_config.rpm_max : 0.0;
+    plant.rpm += (target - plant.rpm) * (1.0 - expf(-dt * 1000.0 / sim_config.tau_ms));
+    plant.blade_phase = fmod(plant.blade_phase + 2.0 * PI * plant.rpm / 60.0 * sim_config.blades * dt, 2.0 * PI);
+}
+
+float load() { return plant.rpm / sim_config.rpm_max; }
+
+float current_locked() {
+    if (plant.rpm < SIM_MIN_RPM) return 0.0;
+    return sim_config.current_idle + (sim_config.current_max - sim_config.current_idle) * powf(load(), 3);
+}
+
+float noise(float sigma) { return sigma * plant.gauss(plant.rng); }
+
+// Conversions of the HX711 at its data rate, DOUT falls when one is ready
+void hx711_thread() {
+    auto period = std::chrono::microseconds(1000000 / SIM_HX711_RATE_HZ);
+    auto next = std::chrono::steady_clock::now();
+    while (true) {
+        next += period;
+        std::this_thread::sleep_until(next);
+        int32_t word = SIM_THRUST_OFFSET + static_cast<int32_t>(lroundf(sim_thrust_kg() * SIM_THRUST_SCALE));
+        word = constrain(word, -0x800000, 0x7FFFFF);
+        bool falling;
+        {
+            std::lock_guard<std::mutex> lock(hx711.mutex);
+            // A conversion being clocked out is not interrupted, the next one is ready instead
+            if (hx711.pulses > 0) continue;
+            hx711.word = word;
+            falling = !hx711.ready;
+            hx711.ready = true;
+            hx711.dout = LOW;
+        }
+        if (falling) sim_interrupt(SIM_THRUST_DT_PIN);
+    }
+}
+
+// IR sensor: one rising edge per revolution, with jitter
+void rpm_thread() {
+    auto last_edge = std::chrono::steady_clock::now();
+    while (true) {
+        float rpm, jitter;
+        {
+            std::lock_guard<std::mutex> lock(plant.mutex);
+            plant_advance();
+            rpm = plant.rpm;
+            jitter = noise(sim_config.rpm_jitter);
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (rpm < SIM_MIN_RPM) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            last_edge = now;
+            continue;
+        }
+        auto period = std::chrono::nanoseconds(static_cast<int64_t>(60.0e9 / rpm * (1.0 + jitter)));
+        last_edge = max(last_edge + period, now);
+        std::this_thread::sleep_until(last_edge);
+        sim_interrupt(SIM_RPM_DOUT_PIN);
+    }
+}
+
+// Press the safety switch once, a second long
+void switch_thread() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(sim_config.switch_ms));
+    switch_level = LOW;
+    sim_interrupt(SIM_SAFETY_SWITCH_PIN);
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    switch_level = HIGH;
+}
+
+}  // namespace
+
+void sim_config_load() {
+    sim_config.rpm_max = env_float("SIM_RPM_MAX", sim_config.rpm_max);
+    sim_config.tau_ms = env_float("SIM_TAU_MS", sim_config.tau_ms);
+    sim_config.thrust_max = env_float("SIM_THRUST_MAX", sim_config.thrust_max);
+    sim_config.current_max = env_float("SIM_CURRENT_MAX", sim_config.current_max);
+    sim_config.current_idle = env_float("SIM_CURRENT_IDLE", sim_config.current_idle);
+    sim_config.battery_v = env_float("SIM_BATTERY_V", sim_config.battery_v);
+    sim_config.battery_r = env_float("SIM_BATTERY_R", sim_config.battery_r);
+    sim_config.blades = env_uint("SIM_BLADES", sim_config.blades);
+    sim_config.vibration = env_float("SIM_VIBRATION", sim_config.vibration);
+    sim_config.thrust_noise = env_float("SIM_THRUST_NOISE", sim_config.thrust_noise);
+    sim_config.current_noise = env_float("SIM_CURRENT_NOISE", sim_config.current_noise);
+    sim_config.voltage_noise = env_float("SIM_VOLTAGE_NOISE", sim_config.voltage_noise);
+    sim_config.rpm_jitter = env_float("SIM_RPM_JITTER", sim_config.rpm_jitter);
+    sim_config.switch_ms = env_uint("SIM_SWITCH_MS", sim_config.switch_ms);
+    sim_config.psram = env_uint("SIM_PSRAM", sim_config.psram) != 0;
+    sim_config.heap = env_uint("SIM_HEAP", sim_config.heap);
+    sim_config.seed = env_uint("SIM_SEED", sim_config.seed);
+    sim_config.serial_port = env_uint("SIM_SERIAL_PORT", sim_config.serial_port);
+    // Every simulator served on its own port is another stand to the host
+    const char *mac = getenv("SIM_MAC");
+    sim_config.mac = mac != nullptr ? strtoull(mac, nullptr, 16) : SIM_DEFAULT_MAC + sim_config.serial_port;
+    sim_config.uart_pace = env_uint("SIM_UART_PACE", sim_config.uart_pace) != 0;
+    sim_config.fuzz = env_uint("SIM_FUZZ", sim_config.fuzz);
+}
+
+void sim_plant_begin() {
+    plant.rng.seed(sim_config.seed);
+    plant.last_us = micros();
+    std::thread(hx711_thread).detach();
+    std::thread(rpm_thread).detach();
+    if (sim_config.switch_ms > 0) std::thread(switch_thread).detach();
+}
+
+void sim_esc_pulse(float pulse_us, double freq_hz) {
+    const EscRange *range = &esc_ranges[0];
+    for (const EscRange &candidate : esc_ranges) {
+        if (fabs(candidate.freq_hz - freq_hz) < fabs(range->freq_hz - freq_hz)) range = &candidate;
+    }
+    std::lock_guard<std::mutex> lock(plant.mutex);
+    plant_advance();
+    plant.throttle = constrain((pulse_us - range->min_us) / (range->max_us - range->min_us), 0.0f, 1.0f);
+}
+
+float sim_current_a() {
+    std::lock_guard<std::mutex> lock(plant.mutex);
+    plant_advance();
+    return current_locked() + noise(sim_config.current_noise);
+}
+
+float sim_voltage_v() {
+    std::lock_guard<std::mutex> lock(plant.mutex);
+    plant_advance();
+    return sim_config.battery_v - sim_config.battery_r * current_locked() + noise(sim_config.voltage_noise);
+}
+
+// Thrust grows with the square of the rpm, the blades shake the cell at the blade pass frequency
+float sim_thrust_kg() {
+    std::lock_guard<std::mutex> lock(plant.mutex);
+    plant_advance();
+    float vibration = plant.rpm < SIM_MIN_RPM ? 0.0 : sim_config.vibration * load() * sinf(plant.blade_phase);
+    return sim_config.thrust_max * load() * load() + vibration + noise(sim_config.thrust_noise);
+}
+
+int sim_hx711_dout() {
+    std::lock_guard<std::mutex> lock(hx711.mutex);
+    return hx711.dout;
+}
+
+// Rising edges of SCK shift out the 24 bits msb first, the 25th selects gain 128 and raises DOUT
+void sim_hx711_clock(int level) {
+    if (level != HIGH) return;
+    std::lock_guard<std::mutex> lock(hx711.mutex);
+    if (!hx711.ready) return;
+    if (hx711.pulses == 0) hx711.shifted = hx711.word;
+    if (hx711.pulses < 24) {
+        hx711.dout = (hx711.shifted >> (23 - hx711.pulses)) & 1;
+    } else {
+        hx711.dout = HIGH;
+    }
+    if (++hx711.pulses == 25) {
+        hx711.pulses = 0;
+        hx711.ready = false;
+    }
+}
+
+int sim_switch_level() { return switch_level; }
@@ -0,0 +1,193 @@
+// FreeRTOS tasks and the hardware timers on host threads
+#include "Arduino.h"
+#include "sim.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct SimTask {
+    explicit SimTask(const char *task_name) : name(task_name) {}
+
+    const char *name;
+    std::mutex mutex;
+    std::condition_variable wake;
+    uint32_t notified = 0;
+};
+
+thread_local SimTask *current_task = nullptr;
+
+// Critical sections and scheduler suspension share one lock: the sections of the firmware are short and
+// never block, so a single lock keeps them exclusive to each other without modeling the two cores
+std::recursive_mutex critical;
+
+SimTask *this_task() {
+    // loop() and the sim threads notify themselves like the firmware tasks do
+    if (current_task == nullptr) current_task = new SimTask("main");
+    return current_task;
+}
+
+}  // namespace
+
+struct hw_timer_s {
+    std::mutex mutex;
+    std::condition_variable changed;
+    void (*isr)() = nullptr;
+    uint16_t divider = 80;
+    uint64_t alarm = 0;
+    bool autoreload = false;
+    bool enabled = false;
+    uint32_t generation = 0;  // Counts the writes, a sleeping timer starts over on any of them
+    Clock::time_point next;
+
+    Clock::duration period() const { return std::chrono::nanoseconds(alarm * divider * 1000 / 80); }
+};
+
+void sim_lock() { critical.lock(); }
+void sim_unlock() { critical.unlock(); }
+
+void portENTER_CRITICAL(portMUX_TYPE *mux) {
+    (void)mux;
+    critical.lock();
+}
+
+void portEXIT_CRITICAL(portMUX_TYPE *mux) {
+    (void)mux;
+    critical.unlock();
+}
+
+void vTaskSuspendAll() { critical.lock(); }
+
+BaseType_t xTaskResumeAll() {
+    critical.unlock();
+    return pdFALSE;
+}
+
+//
+// Tasks
+//
+
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void *), const char *name, uint32_t stack_depth, void *param,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core) {
+    (void)stack_depth;
+    (void)priority;
+    (void)core;
+    SimTask *sim_task = new SimTask(name);
+    // The handle is set before the task runs, as the firmware notifies tasks right after creating them
+    if (handle != nullptr) *handle = sim_task;
+    std::thread([=] {
+        current_task = sim_task;
+        task(param);
+    }).detach();
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken) {
+    if (woken != nullptr) *woken = pdFALSE;
+    if (task == nullptr) return;
+    SimTask *sim_task = static_cast<SimTask *>(task);
+    {
+        std::lock_guard<std::mutex> lock(sim_task->mutex);
+        sim_task->notified++;
+    }
+    sim_task->wake.notify_one();
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+    SimTask *task = this_task();
+    std::unique_lock<std::mutex> lock(task->mutex);
+    auto notified = [task] { return task->notified > 0; };
+    if (ticks == portMAX_DELAY) {
+        task->wake.wait(lock, notified);
+    } else if (!task->wake.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), notified)) {
+        return 0;
+    }
+    uint32_t count = task->notified;
+    task->notified = clear ? 0 : count - 1;
+    return count;
+}
+
+void vTaskDelay(TickType_t ticks) { std::this_thread::sleep_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS)); }
+
+//
+// Hardware timers
+//
+
+namespace {
+
+void timer_thread(hw_timer_s *timer) {
+    std::unique_lock<std::mutex> lock(timer->mutex);
+    while (true) {
+        if (!timer->enabled || timer->alarm == 0) {
+            timer->changed.wait(lock);
+            continue;
+        }
+        uint32_t generation = timer->generation;
+        if (timer->changed.wait_until(lock, timer->next, [&] { return timer->generation != generation; })) continue;
+
+        void (*isr)() = timer->isr;
+        if (timer->autoreload) {
+            timer->next += timer->period();
+            // Skip the alarms missed while the host was busy instead of firing them in a burst
+            if (timer->next < Clock::now()) timer->next = Clock::now() + timer->period();
+        } else {
+            timer->enabled = false;
+        }
+        lock.unlock();
+        if (isr != nullptr) isr();
+        lock.lock();
+    }
+}
+
+// Apply a write to the timer and wake its thread
+template <typename F> void timer_update(hw_timer_t *timer, F update) {
+    {
+        std::lock_guard<std::mutex> lock(timer->mutex);
+        update();
+        timer->generation++;
+    }
+    timer->changed.notify_one();
+}
+
+}  // namespace
+
+hw_timer_t *timerBegin(uint8_t num, uint16_t divider, bool count_up) {
+    (void)num;
+    (void)count_up;
+    hw_timer_t *timer = new hw_timer_s;
+    timer->divider = divider;
+    std::thread(timer_thread, timer).detach();
+    return timer;
+}
+
+void timerAttachInterrupt(hw_timer_t *timer, void (*isr)(), bool edge) {
+    (void)edge;
+    timer_update(timer, [=] { timer->isr = isr; });
+}
+
+void timerAlarmWrite(hw_timer_t *timer, uint64_t alarm_value, bool autoreload) {
+    timer_update(timer, [=] {
+        timer->alarm = alarm_value;
+        timer->autoreload = autoreload;
+        if (timer->enabled) timer->next = Clock::now() + timer->period();
+    });
+}
+
+void timerAlarmEnable(hw_timer_t *timer) {
+    timer_update(timer, [=] {
+        timer->enabled = true;
+        timer->next = Clock::now() + timer->period();
+    });
+}
+
+void timerAlarmDisable(hw_timer_t *timer) {
+    timer_update(timer, [=] { timer->enabled = false; });
+}
+
+void timerRestart(hw_timer_t *timer) {
+    timer_update(timer, [=] { timer->next = Clock::now() + timer->period(); });
+}
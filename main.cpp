@@ -33,29 +33,286 @@
  * 
  * The controller will send back the result in json format.
  * 1. sys_init: The controller will send back a boolean value indicating if the system is ready to run.
- *              Format: {"response_type": "sys_init", "ok": true}
- * 2. measure: The controller will send back an array of measurements.
- *             Format: {"response_type": "measure", "ok": true, "data": [{"throttle": 0, "rpm": 0, "current": 0, "thrust": 0, "voltage": 0}, ...]}
+ *              All the checks run on one shared 500 ms window, every failing one is listed in "faults"
+ *              ("rpm", "current", "voltage", "thrust", "switch").
+ *              "controller_id" (the factory MAC of the ESP32) tells the stands driven by one host apart.
+ *              Format: {"response_type": "sys_init", "ok": false, "faults": ["voltage", "switch"], "controller_id": "24A1609C3A10"}
+ * 2. measure: The controller will send back an array of measurements, "throttle" in % of "throttle_scale".
+ *             Format: {"response_type": "measure", "ok": true, "data": [{"throttle": 0, "rpm": 0, "current": 0, "thrust": 0, "voltage": 0, "timestamp": 0, "settle_ms": 0}, ...]}
+ *             All the values of one step are sampled over the same time window, centered at "timestamp".
+ *             Streamed steps also hold "stats": {"rpm": {"std": 0, "min": 0, "max": 0, "n": 0}, "thrust": ..., "current": ..., "voltage": ...}
+ *             describing the spread of the samples behind each value (rpm: one sample per edge period).
+ *             Sampling starts once RPM and thrust have settled ("settle_ms" after setting the throttle), tuned with
+ *             the optional "settle_timeout_ms", "settle_rpm_tol" (relative) and "settle_thrust_tol" (kg) fields.
+ *             The sampling window of each step is "window_ms" long (default 500 ms).
+ *             The throttle levels follow the "profile": "linear" (default, "steps" + 1 even levels up to "throttle_scale"),
+ *             "log" (exponential from 0, dense at low throttle), "staircase" (up and back down through the same levels, for
+ *             hysteresis) or "levels" (the given [0 - 1, ...], relative to "throttle_scale"). The last level is left
+ *             through a soft ramp-down.
+ *             Buffered sweeps are limited to the steps the result pool allocated at boot can hold, larger
+ *             ones are refused with {"response_type": "measure", "ok": false, "error": "too_many_steps", "max_steps": 0}.
+ *             Without a pool (max_steps 0 and nothing allocated) every buffered sweep is refused, stream instead.
+ *             In binary mode their results are sent as FRAME_STEP records followed by {"response_type": "measure", "ok": true, "count": 21}.
+ *             With "stream": true in the command, every step is sent as soon as it is measured instead,
+ *             followed by a summary frame, so the number of steps is not limited by the controller's memory:
+ *             Format: {"response_type": "measure_step", "seq": 0, "data": {"throttle": 0, "rpm": 0, ...}}
+ *                     {"response_type": "measure", "ok": true, "stream": true, "count": 21, "dropped": 0}
+ * 3. set_protocol: Switch the responses to "json" lines or to "binary" frames, optionally at a new "baud".
+ *                  The reply is still sent with the old protocol and baud, the new ones apply right after it.
+ *              Format: {"response_type": "set_protocol", "ok": true, "protocol": "binary", "baud": 921600}
+ * 4. ramp: Move the throttle continuously along a profile while logging all the channels at "rate_hz".
+ *          The "profile" is "linear" (default) or "log" from 0 to "throttle_scale" over "duration_ms", the "points"
+ *          [[t_ms, throttle], ...] interpolated linearly (here "throttle" is the actual throttle output, 0 - 1),
+ *          or the levels of "steps", "staircase" or "levels" (as for measure), each held "hold_ms".
+ *          The profile is compiled into a table of setpoints played back on a hardware timer, every 1 ms
+ *          or coarser for ramps longer than 8 s (the table holds 8192 setpoints). Each record averages
+ *          one logging interval, its "timestamp" is the middle of it as for measure. Its "throttle" is the
+ *          output in % of "throttle_scale" as for measure, with "points" (no scale) in % of full throttle.
+ *          Format: {"response_type": "ramp_step", "seq": 0, "data": {"throttle": 0, "rpm": 0, ...}}
+ *                  {"response_type": "ramp", "ok": true, "stream": true, "count": 500, "dropped": 0}
+ * 5. set_filter: Set the filter stage run on the "current" or "thrust" samples before they are averaged:
+ *                a 4th order Butterworth low-pass at "lowpass_hz" (0: off), and with "notch": true a notch of
+ *                quality "notch_q" at the blade-pass frequency rpm / 60 * "blades", following the live rpm.
+ *                Thrust is sampled at 80 SPS only, its notch sits at the aliased blade-pass frequency.
+ *                The real time limits and the capture trigger always run on the unfiltered samples.
+ *              Format: {"response_type": "set_filter", "ok": true, "channel": "thrust"}
+ * 6. quick_init: Same checks as sys_init, on the last 100 ms of samples already buffered. The offsets
+ *                restored from flash at boot are kept unless the idle readings have drifted from them.
+ *              Format: {"response_type": "quick_init", "ok": true, "retared": false, "faults": [], "controller_id": "24A1609C3A10"}
+ * 7. set_calibration: Load any of the "current_scale" (A/V), "voltage_scale" (V/V) and "thrust_scale" (counts/kg)
+ *                     coefficients, kept in flash, an empty command only reads them back. ADC readings are converted to mV
+ *                     through lookup tables built at boot from the eFuse characterization ("*_adc_cal").
+ *                     Scales stored by firmware using the plain raw * 3.3 / 4095 conversion are dropped at boot,
+ *                     the current and voltage scales have to be fitted again against a reference meter.
+ *              Format: {"response_type": "set_calibration", "ok": true, "current_scale": 55.735, "voltage_scale": 7.6585,
+ *                       "thrust_scale": 117105.75, "current_adc_cal": "efuse_tp", "voltage_adc_cal": "efuse_tp"}
+ *
+ * Safety: the safety switch, and the real time limits on current, thrust and battery voltage checked by
+ * safety_task(), force the ESC to minimum throttle right away and stop any sweep. The first trip is
+ * reported once with the last samples of every channel before it:
+ *          Format: {"response_type": "trip", "reason": "over_current", "ts_us": 0, "value": 0,
+ *                   "adc": [[ts_us, current, voltage], ...], "thrust": [[ts_us, thrust], ...]}
+ *          The controller then refuses to drive the motor until a clear_trip command (no power cycle needed).
+ *
+ * The ESC is driven with LEDC pulses (PWM, oneshot125 or multishot) or DShot600 frames over RMT, see ESC_PROTOCOL.
+ * With bidirectional DShot the RPM channel is fed by the eRPM telemetry of the ESC instead of the IR sensor.
+ *
+ * The host link (command parsing, serialization and serial writes) runs on core 0, while the acquisition
+ * (ADC sampler, HX711, RPM capture) and the sweep run on core 1. Both sides only talk through lock-free queues.
+ *
+ * sys_init, quick_init, measure and ramp are queued and run one after the other, each "repeat" times (default 1),
+ * so a batch of sweeps can be sent at once. Each one is acknowledged as soon as it is queued, and again when
+ * each of its runs starts; its results carry the same "id" (from the command, or counted by the controller):
+ *          Format: {"response_type": "queued", "command": "measure", "id": 0, "repeat": 5, "queued": 1}
+ *                  {"response_type": "started", "command": "measure", "id": 0, "run": 0}
+ * The controls below skip the queue and are handled within a few ms, even in the middle of a sweep:
+ * - abort: ramp down softly and end the sweep with the steps measured so far ("error": "aborted"),
+ *          the queued commands are dropped and each one is answered with "error": "aborted" as well.
+ * - pause / resume: hold the motor at minimum throttle, then go on (a step sweep measures the interrupted step again).
+ * - set_throttle: set "throttle" (0 - 1) by hand, while no sweep drives it (idle or paused).
+ * - clear_trip: leave the safety trip state once the switch is released and the limits are met again.
+ *          Format: {"response_type": "abort", "ok": true}
+ * A full queue is refused with {"response_type": <command_type>, "ok": false, "error": "busy"}, and so are the
+ * set_* commands while anything is queued or running.
+ *
+ * Commands are json objects, one per line (a closed top level object ends a command as well). Input that
+ * is not a valid command is refused with {"response_type": "error", "ok": false, "error": "parse"}, or
+ * "too_long", "invalid" (no "command_type") and "unknown_command".
+ *
+ * Capture: the raw samples of every channel (characterized mV of the ADC, HX711 counts, rpm edges) of the last
+ * seconds are recorded all the time, 16 s with PSRAM or 2 s without, into an arena allocated at boot.
+ * A safety trip, a current spike of "spike_a" over the average, or a dump command triggers the capture:
+ * it records "post_ms" more (default 1000 ms, none for dump), then holds still until it has been dumped.
+ * - set_capture: set "spike_a" (A, 0: off), "post_ms" and "on_trip", "arm": true drops a held capture.
+ *          Format: {"response_type": "set_capture", "ok": true, "spike_a": 0, "post_ms": 1000, "on_trip": true,
+ *                   "triggered": false, "trigger": "none", "capacity": {"adc": 0, "thrust": 0, "rpm": 0}}
+ * - dump: send the capture (binary mode only) as FRAME_CAPTURE_* frames, then a summary with the counts and
+ *         the conversion of the raw samples, and record again. Refused in json mode with "error": "binary_only".
+ *          Format: {"response_type": "dump", "ok": true, "trigger": "over_current", "trigger_us": 0, "end_us": 0,
+ *                   "frames": 0, "adc": 0, "thrust": 0, "rpm": 0, "current_scale": 55.735, "current_offset": 0,
+ *                   "voltage_scale": 7.6585, "thrust_scale": 117105.75, "thrust_offset": 0}
+ *
+ * Ping: "ping" is answered right away, also in the middle of a sweep, as the heartbeat of the host link.
+ *          Format: {"response_type": "ping", "ok": true, "uptime_ms": 0, "queued": 0, "controller_id": "24A1609C3A10",
+ *                   "firmware": "Oct 14 2026 12:00:00"}
+ *
+ * Stats: "stats" reports where the controller spends its time: n, mean, min and max run time (us) of every instrumented
+ * stage (sampler, safety and scheduler tasks, settle / acquire / reduce / step of each sweep step, init, and the
+ * command parsing, serialization, frame encoding and serial writes of the host link), and the count and rate of
+ * every interrupt, since boot or the last "reset": true. Stages are timed with micros() unless STAGE_STATS is false.
+ *          Format: {"response_type": "stats", "ok": true, "uptime_ms": 0, "since_ms": 0,
+ *                   "stages": {"adc_sample": {"n": 0, "mean_us": 0, "min_us": 0, "max_us": 0}, ...},
+ *                   "isr": {"rpm": {"n": 0, "hz": 0}, ...}, "records_dropped": 0, "free_heap": 0}
+ *
+ * In binary mode every response is a COBS encoded frame terminated by 0x00, holding
+ * [type: u8][payload][crc16-ccitt of type and payload: u16 le]. Commands are still json lines.
+ * - FRAME_JSON: payload is the json text of any of the responses above.
+ * - FRAME_STEP: payload is a packed StepRecord (little endian), replacing the "measure_step" json records.
+ * - FRAME_RAMP_STEP: same StepRecord payload, replacing the "ramp_step" json records.
+ * - FRAME_CAPTURE_ADC / _THRUST / _RPM: [seq: u16] followed by packed AdcCapture, ThrustCapture or u32 edge
+ *   timestamps, oldest first. seq counts the frames of one dump.
  * 
  */
 
 #include <Arduino.h>
+#include <atomic>
+#include <driver/gpio.h>
+#include <esp_adc_cal.h>
+#include <esp_heap_caps.h>
 
 #include <ArduinoJson.h>
 #include <HX711.h>
-#include <ESP32Servo.h>
+#include <driver/rmt.h>
+#include <Preferences.h>
 
 //
 // Constants
 //
 
+#define FIRMWARE_BUILD      __DATE__ " " __TIME__  // Reported by ping, tags the runs stored by the host
+
 // Measuring params
-#define MEASURE_AVERAGE_N   10   // Total number of measurements to take average of
-#define MEASURE_DELAY_MS    10   // Delay between each measurements    
-#define CURRENT_SCALE       63.573     // Convert ADC reading to Amp (with 25.1 mOhm shunt and 10x amp)
-#define THRUST_SCALE        117105.75  // Convert the hx711 raw reading to kilogram
-#define BAT_VOLTAGE_SCALE   8.7355     // Convert ADC reading to volt
-#define MAX_MEASURE_STEPS   20
+// The current and voltage defaults were fitted against the plain raw * 3.3 / 4095 conversion (63.573 and 8.7355),
+// they are rescaled to the nominal slope of the characterized curve: 0.919 mV per reading at 11 dB and 1100 mV vref
+#define CURRENT_SCALE       55.735     // Default Amp per volt at the ADC pin (with 25.1 mOhm shunt and 10x amp)
+#define THRUST_SCALE        117105.75  // Default hx711 raw reading per kilogram
+#define BAT_VOLTAGE_SCALE   7.6585     // Default battery volt per volt at the ADC pin
+#define ADC_LUT_SIZE        4096       // One millivolt entry per 12-bit ADC reading
+#define ADC_DEFAULT_VREF_MV 1100       // ADC reference used by the characterization when the eFuse holds none
+#define MAX_MEASURE_STEPS   1000  // Hard limit of the steps of a buffered sweep, the pool may hold fewer
+#define RESULT_HEAP_RESERVE 65536 // Internal heap left free when the result pool has to be taken from it
+#define ACQUIRE_WINDOW_MS   500   // Shared sampling window of all the channels in one step
+#define ADC_SAMPLE_RATE_HZ  2000  // Timer driven sampling rate of the current and voltage ADC channels
+#define ADC_BUFFER_SIZE     4096  // ADC ring buffer length, must be a power of two (~2 s at 2 kHz)
+#define CURRENT_WINDOW_MS   500   // Window of ADC samples averaged by measure_current()
+#define RPM_MARKS_PER_REV   1     // Number of marks (or blades) passing the IR sensor per revolution
+#define RPM_BUFFER_SIZE     256   // RPM edge timestamp ring buffer length, must be a power of two
+#define RPM_MIN_EDGES       3     // Edges to look back for when the window holds too few of them (slow motor)
+#define RPM_TIMEOUT_MS      500   // No edge for this long means the motor is standing still (< 120 RPM)
+#define RPM_MIN_PERIOD_US   100   // Edges closer than this are treated as glitches
+#define THRUST_SPS          80    // HX711 output rate, set by its RATE pin (high: 80 SPS, low: 10 SPS)
+#define THRUST_BUFFER_SIZE  256   // HX711 reading ring buffer length, must be a power of two (~3 s at 80 SPS)
+#define THRUST_TARE_MS      250   // Window of HX711 readings averaged by thrust_tare()
+#define THRUST_GAIN_PULSES  1     // Extra SCK pulses selecting the next conversion, 1: channel A with gain 128
+#define ACQUIRE_MIN_WINDOW_MS 20  // Range of the sampling window a measure command may ask for
+#define ACQUIRE_MAX_WINDOW_MS 1500
+
+// Filter params
+#define FILTER_LOWPASS_STAGES 2   // Biquad sections of the low-pass, 2: 4th order Butterworth
+#define FILTER_CURRENT_LOWPASS_HZ 0.0  // Filters of the current and thrust channels at boot, 0 Hz: no low-pass
+#define FILTER_THRUST_LOWPASS_HZ  0.0
+#define FILTER_NOTCH_Q      4.0   // Default quality factor of the blade-pass notch
+#define FILTER_BLADES       2     // Default propeller blade count, the notch sits at rpm / 60 * blades
+#define FILTER_MAX_BLADES   8
+#define FILTER_MIN_HZ       2.0   // Lowest corner or notch frequency, the notch is bypassed below it
+#define FILTER_MAX_REL_HZ   0.45  // Highest corner or notch frequency, relative to the sample rate
+#define FILTER_TRACK_MS     20    // Interval of the notch frequency updates from the live rpm
+#define FILTER_TRACK_GAIN   0.25  // Smoothing applied to the tracked notch frequency
+#define FILTER_FRAC_BITS    8     // Fraction bits kept by the filtered current samples
+
+// Capture params
+#define CAPTURE_ADC_SAMPLES 32768  // Raw samples kept of each channel in PSRAM (16 s at 2 kHz), must be powers of two
+#define CAPTURE_THRUST_SAMPLES 2048  // (25 s at 80 SPS)
+#define CAPTURE_RPM_EDGES   16384
+#define CAPTURE_DRAM_SHIFT  3      // Without PSRAM every channel keeps 8 times fewer samples
+#define CAPTURE_POST_MS     1000   // Default time the capture goes on recording after an event
+#define CAPTURE_MAX_POST_MS 10000
+#define CAPTURE_SPIKE_A     0.0    // Default current jump over its slow average that triggers the capture, 0: off
+#define CAPTURE_SPIKE_TAU_MS 200   // Time constant of that average
+#define CAPTURE_SETTLE_MS   50     // Margin after the end of the capture before it is sent
+
+// Safety limits
+#define INIT_MAX_RPM        60.0   // sys_init() idle checks
+#define INIT_MAX_CURRENT    5.0
+#define INIT_MIN_VOLTAGE    3.0
+#define INIT_MAX_THRUST     1.0
+#define INIT_WINDOW_MS      500    // Shared window of samples checked by sys_init()
+#define QUICK_WINDOW_MS     100    // Window of buffered samples checked by quick_init()
+#define QUICK_MAX_CURRENT_DRIFT 0.2   // Idle current (A) and thrust (kg) drift tolerated before quick_init() tares again
+#define QUICK_MAX_THRUST_DRIFT  0.01
+#define LIMIT_MAX_CURRENT   120.0  // Real time limits enforced by safety_task() (A, kg, V)
+#define LIMIT_MAX_THRUST    20.0
+#define LIMIT_MIN_VOLTAGE   6.0    // Only checked while the motor is driven
+#define LIMIT_WINDOW_MS     5      // Window of samples averaged for each real time check
+#define TRIP_ADC_SAMPLES    32     // Samples of each channel reported with a trip
+#define TRIP_THRUST_SAMPLES 8
+
+// Sweep params
+#define SETTLE_MIN_MS       200   // Shortest wait after setting the throttle of a step before sampling
+#define SETTLE_TIMEOUT_MS   3000  // Longest wait, sampling starts anyway if the motor has not settled by then
+#define SETTLE_CHECK_MS     50    // Interval of the rpm and thrust readings watched while settling
+#define SETTLE_WINDOW_N     8     // Readings in the rolling settle window (400 ms)
+#define SETTLE_RPM_TOL      0.01  // Allowed rpm drift and deviation over the window, relative to its mean
+#define SETTLE_RPM_FLOOR    20.0  // Lower bound of the rpm tolerance, for the motor standing still
+#define SETTLE_THRUST_TOL   0.01  // Allowed thrust drift and deviation over the window (kg)
+#define RAMP_DOWN_STEP_MS   300   // Hold time of each step of the soft ramp-down after 100% throttle
+#define RAMP_MAX_POINTS     16    // Points of a user defined continuous ramp profile
+#define RAMP_RATE_HZ        50    // Default logging rate of a continuous ramp
+#define RAMP_MAX_RATE_HZ    500
+#define RAMP_DURATION_MS    10000 // Default duration of a linear continuous ramp
+
+// Profile params
+#define PROFILE_TABLE_SIZE  8192  // Setpoints of the compiled profile: the levels of a step sweep, or the ticks of a ramp
+#define PROFILE_MIN_TICK_US 1000  // Finest tick of a ramp, longer ramps are spread over the table with coarser ticks
+#define PROFILE_MAX_LEVELS  32    // Levels of a custom "levels" profile
+#define PROFILE_HOLD_MS     2000  // Default hold time of each level of a stepped ramp
+#define PROFILE_LOG_BASE    10.0  // Curvature of the "log" profile: its slope at the top is this many times the one at 0
+#define PROFILE_FULL_SCALE  65535 // Setpoint of full throttle in the table
+
+// LED patterns
+#define LED_STANDBY_MS      1000  // Green LED blinking period while idle
+#define LED_GAP_MS          100
+#define LED_BLINK_MS        250
+#define LED_QUEUE_SIZE      8
+
+// Task config
+#define SWEEP_TASK_US       0      // Scheduler intervals, 0 runs the task on every pass
+#define LED_TASK_US         10000
+#define COMMAND_TASK_US     1000
+#define CONTROL_TASK_US     0
+#define STAGE_STATS         true   // Time the instrumented stages for the stats command
+#define COMM_TASK_PRIORITY  2
+#define COMM_TASK_CORE      0
+#define COMM_TASK_STACK     8192
+#define COMMAND_QUEUE_SIZE  8      // Commands waiting for the ones before them to finish
+#define COMMAND_MAX_REPEAT  100    // Runs of one queued command
+#define RECORD_QUEUE_SIZE   64
+#define CONTROL_QUEUE_SIZE  4
+#define PROFILE_TIMER_ID    2
+#define PROFILE_TASK_PRIORITY 3
+#define PROFILE_TASK_CORE   1
+#define ADC_TIMER_ID        0
+#define ADC_TASK_PRIORITY   5
+#define ADC_TASK_CORE       1
+#define THRUST_TASK_PRIORITY 6
+#define THRUST_TASK_CORE    1
+#define THRUST_READY_TIMEOUT_MS 50  // Poll DOUT as well, in case a data ready edge was missed
+#define SAFETY_TASK_PRIORITY (configMAX_PRIORITIES - 1)
+#define SAFETY_TASK_CORE    1
+#define SAFETY_CHECK_MS     1
+
+// ESC config
+#define ESC_PROTOCOL_PWM        0  // Throttle output protocols, the pulse width ones are timed by esc_timings[]
+#define ESC_PROTOCOL_ONESHOT125 1
+#define ESC_PROTOCOL_MULTISHOT  2
+#define ESC_PROTOCOL_DSHOT600   3
+#define ESC_PROTOCOL        ESC_PROTOCOL_PWM
+#define ESC_LEDC_CHANNEL    0
+#define ESC_DSHOT_BIDIR     true   // Bidirectional DShot, its eRPM telemetry then replaces the IR sensor
+#define ESC_DSHOT_RATE_HZ   2000   // DShot frame rate
+#define ESC_MOTOR_POLES     14     // Magnet poles of the motor, eRPM = RPM * poles / 2
+#define ESC_TIMER_ID        1
+#define ESC_TASK_PRIORITY   4
+#define ESC_TASK_CORE       1
+#define ESC_RMT_TX_CHANNEL  RMT_CHANNEL_0
+#define ESC_RMT_RX_CHANNEL  RMT_CHANNEL_2
+#define DSHOT_BIT_TICKS     133    // DShot600 bit (1.67 us) at the 80 MHz RMT clock
+#define DSHOT_T1H_TICKS     100    // High time of a 1 bit (1.25 us)
+#define DSHOT_T0H_TICKS     50     // High time of a 0 bit (0.625 us)
+#define DSHOT_REPLY_BIT_TICKS 107  // eRPM replies run at 5 / 4 of the bit rate (750 kbit/s)
+#define DSHOT_RX_IDLE_TICKS 800    // A reply is over after 10 us without an edge
+#define DSHOT_RX_FILTER_TICKS 20   // Pulses shorter than 250 ns are noise
+#define RPM_FROM_TELEMETRY  (ESC_PROTOCOL == ESC_PROTOCOL_DSHOT600 && ESC_DSHOT_BIDIR)
 
 // PIN config
 #define SAFETY_SWITCH_PIN   15
@@ -68,398 +325,3135 @@
 #define BAT_VOLTAGE_PIN     32
 #define ESC_COMMAND_PIN     13
 
+// Storage config
+#define NVS_NAMESPACE       "teststand"
+#define NVS_VERSION         2     // Layout of StoredCalibration, older ones are ignored. 2: scales of the characterized ADC
+#define NVS_MAX_BOOTS       20    // Stored offsets are measured again after this many boots
+
+// Serial config
+#define SERIAL_BAUD         115200
+#define SERIAL_MAX_BAUD     2000000
+#define COMMAND_LINE_SIZE   1024  // Longest command accepted from the host
+#define COMMAND_DOC_SIZE    1536  // Parsed command, strings are not copied (zero-copy parsing of the line)
+#define FRAME_MAX_PAYLOAD   3072  // Largest binary frame payload (the trip report json)
+#define FRAME_JSON          0x01
+#define FRAME_STEP          0x02
+#define FRAME_RAMP_STEP     0x03
+#define FRAME_CAPTURE_ADC   0x04
+#define FRAME_CAPTURE_THRUST 0x05
+#define FRAME_CAPTURE_RPM   0x06
+
 // Conversion
 #define S_TO_MILLIS   1000.0
 
 //
-// Global variables
+// Types
 //
 
+// Lock-free ring buffer with a single producer (ISR or task) and any number of readers.
+// The producer never blocks and overwrites the oldest item, readers walk back from the newest one.
+template <typename T, uint32_t N>
+struct RingBuffer {
+    static_assert((N & (N - 1)) == 0, "RingBuffer size must be a power of two");
+
+    T items[N];
+    std::atomic<uint32_t> head{0};  // Total number of items ever pushed
+
+    void push(const T &item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        items[h & (N - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    // The n-th newest item, n = 0 is the newest
+    const T &recent(uint32_t n, uint32_t h) const {
+        return items[(h - 1 - n) & (N - 1)];
+    }
+};
+
+// Lock-free queue with exactly one producer and one consumer, which may run on different cores
+template <typename T, uint32_t N>
+struct SpscQueue {
+    static_assert((N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+    T items[N];
+    std::atomic<uint32_t> head{0};  // Only written by the producer
+    std::atomic<uint32_t> tail{0};  // Only written by the consumer
+
+    bool push(const T &item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= N) return false;
+        items[h & (N - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    uint32_t size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    bool pop(T &item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return false;
+        item = items[t & (N - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+struct AdcSample {
+    uint32_t ts_us;
+    uint16_t current_raw;
+    uint16_t voltage_raw;
+    int32_t current_filtered;  // Output of the current filter, in 1 / 2^FILTER_FRAC_BITS mV
+};
+
+struct ThrustSample {
+    uint32_t ts_us;
+    int32_t raw;
+    int32_t filtered;  // Output of the thrust filter, in HX711 counts
+};
+
+// Raw samples kept by the capture, packed as they are sent in the FRAME_CAPTURE_* frames
+struct __attribute__((packed)) AdcCapture {
+    uint32_t ts_us;
+    uint16_t current_mv;  // Characterized, before the offset and the filter
+    uint16_t voltage_mv;
+};
+
+struct __attribute__((packed)) ThrustCapture {
+    uint32_t ts_us;
+    int32_t raw;  // HX711 counts, before the offset and the filter
+};
+
+// Ring buffer over an arena allocated at boot, its power of two length is picked at run time
+template <typename T>
+struct ArenaRing {
+    T *items = nullptr;
+    uint32_t mask = 0;
+    std::atomic<uint32_t> head{0};  // Total number of items ever pushed
+    uint32_t start = 0;             // First item recorded since the capture was armed
+
+    void push(const T &item) {
+        if (items == nullptr) return;
+        uint32_t h = head.load(std::memory_order_relaxed);
+        items[h & mask] = item;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    // Oldest item still held, the slot behind it is left to a late writer
+    uint32_t first(uint32_t h) const {
+        return h - min(h - start, mask);
+    }
+
+    const T &at(uint32_t i) const {
+        return items[i & mask];
+    }
+};
+
+// Second order IIR section (transposed direct form II), coefficients normalized by a0
+struct Biquad {
+    float b0 = 1.0, b1 = 0.0, b2 = 0.0;
+    float a1 = 0.0, a2 = 0.0;
+    float z1 = 0.0, z2 = 0.0;
+
+    float process(float x) {
+        float y = b0 * x + z1;
+        z1 = b1 * x - a1 * y + z2;
+        z2 = b2 * x - a2 * y;
+        return y;
+    }
+
+    // Start in the steady state of a constant input x, all the sections used here have unity gain at DC
+    void reset(float x) {
+        z1 = x * (1.0 - b0);
+        z2 = x * (b2 - a2);
+    }
+
+    // Coefficients from the RBJ audio EQ cookbook
+    void set_lowpass(float f0, float fs, float q) {
+        float w0 = 2.0 * PI * f0 / fs;
+        float cos_w0 = cosf(w0);
+        float alpha = sinf(w0) / (2.0 * q);
+        float a0 = 1.0 + alpha;
+        b0 = (1.0 - cos_w0) / 2.0 / a0;
+        b1 = (1.0 - cos_w0) / a0;
+        b2 = b0;
+        a1 = -2.0 * cos_w0 / a0;
+        a2 = (1.0 - alpha) / a0;
+    }
+
+    void set_notch(float f0, float fs, float q) {
+        float w0 = 2.0 * PI * f0 / fs;
+        float cos_w0 = cosf(w0);
+        float alpha = sinf(w0) / (2.0 * q);
+        float a0 = 1.0 + alpha;
+        b0 = 1.0 / a0;
+        b1 = -2.0 * cos_w0 / a0;
+        b2 = b0;
+        a1 = b1;
+        a2 = (1.0 - alpha) / a0;
+    }
+};
+
+// Filter settings of one channel
+struct FilterConfig {
+    float lowpass_hz = 0.0;  // Corner of the Butterworth low-pass, 0 disables it
+    bool notch = false;      // Notch at the blade-pass frequency, tracking the live rpm
+    float notch_q = FILTER_NOTCH_Q;
+    int blades = FILTER_BLADES;
+};
+
+// Filter stage of one channel, run by the task sampling it. New settings are handed over through
+// pending and only picked up by that task, between two samples.
+struct ChannelFilter {
+    float fs;  // Sample rate of the channel (Hz)
+    FilterConfig config;
+    Biquad lowpass[FILTER_LOWPASS_STAGES];
+    Biquad notch;
+    float notch_hz = 0.0;  // Current notch frequency, 0 while bypassed
+    uint32_t next_track_us = 0;
+    bool primed = false;
+
+    FilterConfig pending;
+    std::atomic<bool> update{false};
+};
+
+enum TripReason {
+    TRIP_NONE,
+    TRIP_SWITCH,
+    TRIP_OVER_CURRENT,
+    TRIP_OVER_THRUST,
+    TRIP_UNDER_VOLTAGE
+};
+
+// Conversion coefficients of the measuring channels, loaded at runtime by the host
+struct Calibration {
+    float current_scale = CURRENT_SCALE;      // A / V
+    float voltage_scale = BAT_VOLTAGE_SCALE;  // V / V
+    float thrust_scale = THRUST_SCALE;        // HX711 counts / kg
+    esp_adc_cal_value_t current_cal = ESP_ADC_CAL_VAL_DEFAULT_VREF;  // Source of the ADC characterizations
+    esp_adc_cal_value_t voltage_cal = ESP_ADC_CAL_VAL_DEFAULT_VREF;
+};
+
+// Calibration and offsets kept in NVS across reboots
+struct __attribute__((packed)) StoredCalibration {
+    uint16_t version;
+    float current_scale;
+    float voltage_scale;
+    float thrust_scale;
+    float current_offset;
+    int32_t thrust_offset;
+    uint32_t boot;  // Boot in which the offsets were measured
+};
+
+const char *adc_cal_names[] = {"efuse_vref", "efuse_tp", "default_vref"};
+
+// Pulse range (throttle 0 to 1) and LEDC setup of a pulse width protocol
+struct EscTiming {
+    float min_us;
+    float max_us;
+    uint32_t freq_hz;
+    uint8_t bits;
+};
+
+const EscTiming esc_timings[] = {
+    {1100.0, 1940.0, 50,   16},  // PWM, 0.3 us steps
+    {137.5,  242.5,  2000, 15},  // Oneshot125: PWM / 8
+    {7.0,    23.8,   8000, 13},  // Multishot: 5 us + (PWM - 1000 us) / 50
+};
+
+// 5-bit GCR codes of the DShot eRPM replies to their nibbles, invalid codes are caught by the checksum
+const uint8_t dshot_gcr[32] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 9, 10, 11, 0, 13, 14, 15,
+                               0, 0, 2, 3, 0, 5, 6, 7, 0, 0, 8, 1, 0, 4, 12, 0};
+
+// Q of the sections of a Butterworth low-pass of order 2 * FILTER_LOWPASS_STAGES
+const float butterworth_q[FILTER_LOWPASS_STAGES] = {0.5412, 1.3066};
+
+const char *trip_names[] = {"none", "switch", "over_current", "over_thrust", "under_voltage"};
+
+// Failed checks of sys_init and quick_init, blinked as patterns of (fault + 1) yellow blinks
+enum InitFault {
+    INIT_FAULT_RPM,
+    INIT_FAULT_CURRENT,
+    INIT_FAULT_VOLTAGE,
+    INIT_FAULT_THRUST,
+    INIT_FAULT_SWITCH,
+    INIT_FAULT_COUNT
+};
+
+const char *init_fault_names[] = {"rpm", "current", "voltage", "thrust", "switch"};
+
+// First safety trip and the samples leading up to it, reported by the host link
+struct Trip {
+    TripReason reason = TRIP_NONE;
+    uint32_t ts_us = 0;
+    float value = 0.0;
+    AdcSample adc[TRIP_ADC_SAMPLES];
+    int n_adc = 0;
+    ThrustSample thrust[TRIP_THRUST_SAMPLES];
+    int n_thrust = 0;
+};
+
+// Raw samples of every channel over the last seconds, recorded all the time. An event triggers it:
+// the channels go on recording until end_us, then the capture holds still until it has been dumped.
+struct Capture {
+    ArenaRing<AdcCapture> adc;
+    ArenaRing<ThrustCapture> thrust;
+    ArenaRing<uint32_t> rpm;  // Edge timestamps (us)
+    std::atomic<bool> triggered{false};
+    const char *trigger = "none";  // Event that triggered it
+    uint32_t trigger_us = 0;
+    uint32_t end_us = 0;
+
+    // Events, set by the host
+    uint32_t post_ms = CAPTURE_POST_MS;
+    float spike_a = CAPTURE_SPIKE_A;
+    bool on_trip = true;
+
+    // Spike detection, by safety_task()
+    bool watching = false;
+    float current_avg = 0.0;
+
+    // Whether a sample taken at ts_us is still recorded
+    bool recording(uint32_t ts_us) const {
+        if (!triggered.load(std::memory_order_acquire)) return true;
+        return static_cast<int32_t>(ts_us - end_us) < 0;
+    }
+};
+
+enum Protocol {
+    PROTOCOL_JSON,
+    PROTOCOL_BINARY
+};
+
+// Binary layout of one streamed step, see FRAME_STEP
+struct __attribute__((packed)) StepRecord {
+    uint16_t seq;
+    float throttle;
+    float rpm;
+    float thrust;
+    float current;
+    float voltage;
+    uint32_t timestamp;
+    uint16_t settle_ms;
+    float rpm_std, rpm_min, rpm_max;
+    float thrust_std, thrust_min, thrust_max;
+    float current_std, current_min, current_max;
+    float voltage_std, voltage_min, voltage_max;
+};
+
+enum LedState {
+    LED_STANDBY,
+    LED_LEAD,
+    LED_BLINK_ON,
+    LED_BLINK_OFF,
+    LED_FAULT
+};
+
+enum SweepState {
+    SWEEP_IDLE,
+    SWEEP_SETTLE,
+    SWEEP_ACQUIRE,
+    SWEEP_CONTINUOUS,
+    SWEEP_RAMP_DOWN,
+    SWEEP_PAUSED
+};
+
+// Instrumented stages, timed for the stats command
+enum Stage {
+    STAGE_ADC_SAMPLE,    // Sampler and safety tasks
+    STAGE_THRUST_READ,
+    STAGE_ESC_FRAME,
+    STAGE_PROFILE_TICK,
+    STAGE_SAFETY_CHECK,
+    STAGE_CONTROL_TASK,  // Scheduler tasks
+    STAGE_COMMAND_TASK,
+    STAGE_SWEEP_TASK,
+    STAGE_LED_TASK,
+    STAGE_SETTLE,        // Sweep steps
+    STAGE_ACQUIRE,
+    STAGE_REDUCE,
+    STAGE_STEP,
+    STAGE_INIT,          // sys_init and quick_init
+    STAGE_PARSE,         // Host link
+    STAGE_SERIALIZE,
+    STAGE_FRAME_ENCODE,
+    STAGE_SERIAL_WRITE,
+    STAGE_COUNT
+};
+
+const char *stage_names[] = {"adc_sample", "thrust_read", "esc_frame", "profile_tick", "safety_check",
+                             "control_task", "command_task", "sweep_task", "led_task",
+                             "settle", "acquire", "reduce", "step", "init",
+                             "parse", "serialize", "frame_encode", "serial_write"};
+
+// Interrupts counted for the stats command
+enum IsrCounter {
+    ISR_SWITCH,
+    ISR_RPM,
+    ISR_ADC_TIMER,
+    ISR_ESC_TIMER,
+    ISR_PROFILE_TIMER,
+    ISR_THRUST_READY,
+    ISR_COUNT
+};
+
+const char *isr_names[] = {"switch", "rpm", "adc_timer", "esc_timer", "profile_timer", "thrust_ready"};
+
+// Run time of one stage, written by the one task running it and read by the host link,
+// which may see it one update behind
+struct StageStats {
+    uint32_t n = 0;
+    uint32_t min_us = UINT32_MAX;
+    uint32_t max_us = 0;
+    uint64_t total_us = 0;
+    std::atomic<bool> reset{false};  // Asked by the host link, done by the writer on its next update
+
+    void add(uint32_t us) {
+        if (reset.exchange(false, std::memory_order_acquire)) {
+            n = 0;
+            min_us = UINT32_MAX;
+            max_us = 0;
+            total_us = 0;
+        }
+        n++;
+        total_us += us;
+        if (us < min_us) min_us = us;
+        if (us > max_us) max_us = us;
+    }
+};
+
+// Cooperative task run by scheduler_run() every interval_us
+struct Task {
+    const char *name;
+    unsigned long interval_us;
+    void (*run)();
+    unsigned long last_us;
+    Stage stage;
+};
+
+// Streaming mean, variance, min and max of one channel (Welford), O(1) memory
+struct RunningStats {
+    uint32_t n = 0;
+    float mean = 0.0;
+    float m2 = 0.0;
+    float min = 0.0;
+    float max = 0.0;
+
+    void add(float x) {
+        n++;
+        if (n == 1) {
+            min = x;
+            max = x;
+        }
+        else {
+            min = fminf(min, x);
+            max = fmaxf(max, x);
+        }
+        float delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    float variance() const {
+        return n > 1 ? m2 / (n - 1) : 0.0;
+    }
+
+    float stddev() const {
+        return sqrtf(variance());
+    }
+};
+
+// Spread of the samples behind one measured value, in the unit of the channel
+struct ChannelStats {
+    float std = 0.0;
+    float min = 0.0;
+    float max = 0.0;
+    uint32_t n = 0;
+};
+
 struct Measurements {
     float throttle = 0.0;
-    int rpm =        0;
+    float rpm =      0.0;
     float thrust =   0.0;
     float current =  0.0;
     float voltage =  0.0;
+    unsigned long timestamp = 0;  // Middle of the sampling window (ms since boot)
+    unsigned long settle_ms = 0;  // Time the step took to settle before sampling
+    ChannelStats rpm_stats;
+    ChannelStats thrust_stats;
+    ChannelStats current_stats;
+    ChannelStats voltage_stats;
+};
+
+// Rolling window of rpm and thrust readings, used to detect when a step has settled
+struct SettleWindow {
+    float rpm[SETTLE_WINDOW_N];
+    float thrust[SETTLE_WINDOW_N];
+    int n = 0;  // Total number of readings pushed
+};
+
+Measurements *measurements = nullptr;  // Results of a buffered sweep, allocated once by results_begin()
+int max_measure_steps = 0;             // Steps the result pool can hold (steps + 1 entries)
+
+enum CommandType {
+    COMMAND_SYS_INIT,
+    COMMAND_MEASURE,
+    COMMAND_RAMP,
+    COMMAND_QUICK_INIT,
+    COMMAND_ABORT,         // Controls, handled right away instead of being queued
+    COMMAND_PAUSE,
+    COMMAND_RESUME,
+    COMMAND_SET_THROTTLE,
+    COMMAND_CLEAR_TRIP
+};
+
+const char *command_names[] = {"sys_init", "measure", "ramp", "quick_init",
+                               "abort", "pause", "resume", "set_throttle", "clear_trip"};
+
+// Shapes of the throttle profiles, compiled into the setpoint table before a sweep or ramp runs
+enum ProfileKind {
+    PROFILE_LINEAR,     // Even levels (sweep), or a straight ramp over "duration_ms"
+    PROFILE_LOG,        // Exponential curve shifted through 0, dense at low throttle
+    PROFILE_POINTS,     // Ramp only, interpolated between the "points"
+    PROFILE_STEPS,      // Even levels, each held "hold_ms" (a sweep is stepped anyway)
+    PROFILE_STAIRCASE,  // Even levels up, then back down through the same levels, for hysteresis
+    PROFILE_LEVELS,     // The given "levels"
+    PROFILE_COUNT
+};
+
+const char *profile_names[] = {"linear", "log", "points", "steps", "staircase", "levels"};
+
+// One point of a continuous ramp profile
+struct RampPoint {
+    uint32_t t_ms;
+    float throttle;
+};
+
+// Command parsed by the host link, executed by the acquisition side
+struct Command {
+    CommandType type = COMMAND_SYS_INIT;
+    uint32_t id = 0;  // Tag of the command in the replies, given by the host or counted by the controller
+    int repeat = 1;   // Times the command is run back to back
+    int steps = 0;
+    float throttle_scale = 1.0;
+    bool stream = false;
+    ProfileKind profile = PROFILE_LINEAR;
+    RampPoint points[RAMP_MAX_POINTS];
+    int n_points = 0;
+    float levels[PROFILE_MAX_LEVELS];  // Relative to throttle_scale, like the even levels
+    int n_levels = 0;
+    uint32_t duration_ms = RAMP_DURATION_MS;
+    uint32_t hold_ms = PROFILE_HOLD_MS;
+    int rate_hz = RAMP_RATE_HZ;
+    unsigned long settle_timeout_ms = SETTLE_TIMEOUT_MS;
+    float settle_rpm_tol = SETTLE_RPM_TOL;
+    float settle_thrust_tol = SETTLE_THRUST_TOL;
+    unsigned long window_ms = ACQUIRE_WINDOW_MS;
+};
+
+enum RecordType {
+    RECORD_SYS_INIT,
+    RECORD_STEP,
+    RECORD_SWEEP_DONE,
+    RECORD_ERROR,
+    RECORD_STARTED,
+    RECORD_CONTROL
+};
+
+// Result handed from the acquisition side to the host link, which serializes it
+struct Record {
+    RecordType type = RECORD_SYS_INIT;
+    CommandType command = COMMAND_SYS_INIT;
+    uint32_t id = 0;
+    int run = 0;
+    bool has_id = false;  // Reply to a queued command, tagged with its id and run
+    bool ok = true;
+    bool stream = false;
+    int seq = 0;
+    int count = 0;
+    const char *error = nullptr;  // Static string of RECORD_ERROR
+    bool retared = false;         // quick_init measured the offsets again
+    uint8_t faults = 0;           // INIT_FAULT_* bits of a failed sys_init or quick_init
+    Measurements m;
 };
 
-Measurements measurements[MAX_MEASURE_STEPS + 1];
+SpscQueue<Command, COMMAND_QUEUE_SIZE> commands;
+SpscQueue<Command, CONTROL_QUEUE_SIZE> controls;
+SpscQueue<Record, RECORD_QUEUE_SIZE> records;
+std::atomic<uint32_t> records_dropped{0};
+std::atomic<bool> sweep_active{false};
+std::atomic<bool> batch_active{false};  // A queued command is being run, or has runs left
+std::atomic<bool> results_pending{false};  // Buffered sweep results not serialized yet
+TaskHandle_t comm_task_handle = nullptr;
+uint32_t next_command_id = 0;  // Only used by the host link
+
+// Shared sampling window in progress
+struct Acquisition {
+    unsigned long start_ts = 0;
+    uint32_t start_us = 0;
+    unsigned long window_ms = 0;
+} acquisition;
+
+// Capture dump in progress, sent one frame per pass of the host link by dump_poll()
+struct Dump {
+    bool pending = false;  // Waiting for the end of the capture
+    bool active = false;
+    int channel = 0;       // 0: adc, 1: thrust, 2: rpm, then the summary
+    uint32_t next[3];
+    uint32_t end[3];
+    uint32_t count[3];
+    uint16_t seq = 0;
+} dump;
+
+// Command being run by command_task(), repeat times in a row
+struct Batch {
+    Command command;
+    int run = 0;
+    int runs_left = 0;
+} batch;
+
+// Sweep in progress, advanced by sweep_task()
+struct Sweep {
+    SweepState state = SWEEP_IDLE;
+    int step = 0;
+    int steps = 0;
+    float throttle_scale = 1.0;
+    bool stream = false;
+    int count = 0;
+    int ramp_i = 0;
+    unsigned long state_ts = 0;
+    Measurements m;
+    bool aborted = false;
+    uint32_t step_start_us = 0;
+
+    // Pause
+    SweepState paused_state = SWEEP_IDLE;
+
+    // Settle detection
+    SettleWindow settle;
+    unsigned long next_check_ms = 0;
+    unsigned long settle_timeout_ms = SETTLE_TIMEOUT_MS;
+    float settle_rpm_tol = SETTLE_RPM_TOL;
+    float settle_thrust_tol = SETTLE_THRUST_TOL;
+    unsigned long window_ms = ACQUIRE_WINDOW_MS;  // Sampling window of each step
+
+    // Continuous ramp
+    CommandType command = COMMAND_MEASURE;
+    uint32_t log_interval_us = 0;
+    uint32_t next_log_us = 0;
+} sweep;
+
+// Setpoint table of the sweep or ramp in progress. A sweep sets one entry per step, a ramp is
+// played back by profile_task(), one entry on every tick of the profile timer
+struct Profile {
+    uint16_t table[PROFILE_TABLE_SIZE];  // Throttle output, 0 - PROFILE_FULL_SCALE
+    int len = 0;
+    uint32_t tick_us = 0;
+    std::atomic<int> index{0};  // Next entry played back
+    std::atomic<bool> running{false};
+    std::atomic<bool> done{false};
+} profile;
+hw_timer_t *profile_timer = nullptr;
+TaskHandle_t profile_task_handle = nullptr;
+
+RingBuffer<AdcSample, ADC_BUFFER_SIZE> adc_samples;
+hw_timer_t *adc_timer = nullptr;
+TaskHandle_t adc_task_handle = nullptr;
+unsigned long adc_start_us = 0;
+
+RingBuffer<ThrustSample, THRUST_BUFFER_SIZE> thrust_samples;
+TaskHandle_t thrust_task_handle = nullptr;
+portMUX_TYPE thrust_mux = portMUX_INITIALIZER_UNLOCKED;
+unsigned long thrust_start_us = 0;
+
+ChannelFilter current_filter;
+ChannelFilter thrust_filter;
+portMUX_TYPE filter_mux = portMUX_INITIALIZER_UNLOCKED;  // Guards the pending settings of both filters
 
 float current_offset = 0.0;
+Calibration calibration;
+uint32_t boot_count = 0;
+char controller_id[13];  // Factory MAC as hex, names the stand to a host driving several of them
+uint16_t current_lut[ADC_LUT_SIZE];  // Characterized millivolts of every ADC reading, per ADC unit
+uint16_t voltage_lut[ADC_LUT_SIZE];
+
+Protocol protocol = PROTOCOL_JSON;
+uint8_t frame_raw[FRAME_MAX_PAYLOAD + 3];
+uint8_t frame_encoded[sizeof(frame_raw) + sizeof(frame_raw) / 254 + 2];
+
+// Command collected from the serial stream without blocking, complete at a newline or once
+// its top level json object is closed
+struct CommandReader {
+    char line[COMMAND_LINE_SIZE + 1];
+    size_t len = 0;
+    int depth = 0;
+    bool in_string = false;
+    bool escape = false;
+    bool overflow = false;
+} command_reader;
 
 unsigned long standby_ts = 0;
 bool is_gled_on = true;
+LedState led_state = LED_STANDBY;
+unsigned long led_ts = 0;
+int led_blinks_left = 0;
+int led_queue[LED_QUEUE_SIZE];
+int led_queue_len = 0;
 
-volatile bool system_paused = false;
-volatile int rpm_count = 0;
+volatile bool system_paused = false;  // Set by any safety trip, the ESC is then held at minimum
+volatile uint32_t switch_trip_us = 0;
+TaskHandle_t safety_task_handle = nullptr;
+Trip trip;
+Capture capture;
+portMUX_TYPE capture_mux = portMUX_INITIALIZER_UNLOCKED;
+std::atomic<bool> trip_pending{false};
+float throttle_output = 0.0;
+RingBuffer<uint32_t, RPM_BUFFER_SIZE> rpm_edges;  // Timestamps (us) of the RPM sensor edges
+volatile uint32_t rpm_last_edge_us = 0;
+volatile uint32_t rpm_period_us = 0;  // Period between the last two edges, tracked by the notch filters
 
 HX711 scale;
-Servo esc;
+std::atomic<uint16_t> dshot_value{0};  // Next DShot throttle value, 0: stop, 48 - 2047: throttle
+hw_timer_t *esc_timer = nullptr;
+TaskHandle_t esc_task_handle = nullptr;
+RingbufHandle_t dshot_rx_buffer = nullptr;
+uint32_t dshot_next_edge_us = 0;  // Next RPM edge laid out from the telemetry
+bool dshot_spinning = false;
+
+StageStats stage_stats[STAGE_COUNT];
+volatile uint32_t isr_hits[ISR_COUNT];  // Since boot
+uint32_t isr_hits_base[ISR_COUNT];      // At the last reset of the stats, only used by the host link
+uint32_t stats_since_us = 0;
+
+// Adds the run time of the scope it lives in to a stage
+struct StageTimer {
+    Stage stage;
+    uint32_t start_us;
+
+    explicit StageTimer(Stage stage) : stage(stage), start_us(STAGE_STATS ? micros() : 0) {}
+    ~StageTimer() {
+        if (STAGE_STATS) stage_stats[stage].add(micros() - start_us);
+    }
+};
 
 //
 // ISRs
 //
 
 // Safty switch interrupt handling
-void system_pause_isr() {
+void IRAM_ATTR system_pause_isr() {
+    isr_hits[ISR_SWITCH]++;
     system_paused = true;
+    switch_trip_us = micros();
+    if (safety_task_handle == nullptr) return;
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(safety_task_handle, &woken);
+    if (woken) portYIELD_FROM_ISR();
 }
 
 // RPM measuring interrupt handling
-void rpm_counting_isr() {
-    rpm_count++;
+void IRAM_ATTR rpm_counting_isr() {
+    isr_hits[ISR_RPM]++;
+    uint32_t now_us = micros();
+    if (now_us - rpm_last_edge_us < RPM_MIN_PERIOD_US) return;
+    rpm_period_us = now_us - rpm_last_edge_us;
+    rpm_last_edge_us = now_us;
+    rpm_edges.push(now_us);
+    if (capture.recording(now_us)) capture.rpm.push(now_us);
+}
+
+// ADC sampling timer interrupt handling
+void IRAM_ATTR adc_timer_isr() {
+    isr_hits[ISR_ADC_TIMER]++;
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(adc_task_handle, &woken);
+    if (woken) portYIELD_FROM_ISR();
+}
+
+// ESC frame timer interrupt handling
+void IRAM_ATTR esc_timer_isr() {
+    isr_hits[ISR_ESC_TIMER]++;
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(esc_task_handle, &woken);
+    if (woken) portYIELD_FROM_ISR();
+}
+
+// Profile playback timer interrupt handling
+void IRAM_ATTR profile_timer_isr() {
+    isr_hits[ISR_PROFILE_TIMER]++;
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(profile_task_handle, &woken);
+    if (woken) portYIELD_FROM_ISR();
+}
+
+// HX711 data ready (DOUT falling) interrupt handling
+void IRAM_ATTR thrust_ready_isr() {
+    isr_hits[ISR_THRUST_READY]++;
+    // DOUT toggles while the word is clocked out, so stay off until thrust_task() has read it
+    gpio_intr_disable(static_cast<gpio_num_t>(THRUST_DT_PIN));
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(thrust_task_handle, &woken);
+    if (woken) portYIELD_FROM_ISR();
 }
 
 //
-// Functions
+// Tasks
 //
 
-// Measure rpm
-int measure_rpm() {
-    unsigned long current_time = millis();
-    unsigned long time_lapse_ms = 1000;
-    rpm_count = 0;
-    while (millis() - current_time < time_lapse_ms) {}
-    return rpm_count * (60 * S_TO_MILLIS / time_lapse_ms);
+// Hand new settings over to the task running a filter
+void filter_configure(ChannelFilter &filter, const FilterConfig &config) {
+    portENTER_CRITICAL(&filter_mux);
+    filter.pending = config;
+    filter.update.store(true, std::memory_order_release);
+    portEXIT_CRITICAL(&filter_mux);
 }
 
-// Measure current
-float measure_current(float offset = 0.0) {
-    float sum = 0.0;
-    for (int i = 0; i < MEASURE_AVERAGE_N * 5; i++) {
-        sum += static_cast<float>(analogRead(CURRENT_AOUT_PIN)) * (3.3 / 4095.0) * CURRENT_SCALE + offset;;
-        delay(MEASURE_DELAY_MS);
+// Blade-pass frequency seen at the sample rate of a filter (aliased into [0, fs / 2]), 0 with the motor stopped
+float filter_blade_pass_hz(const ChannelFilter &filter, uint32_t now_us) {
+    uint32_t period_us = rpm_period_us;
+    if (period_us == 0 || now_us - rpm_last_edge_us > RPM_TIMEOUT_MS * 1000) return 0.0;
+    float hz = 1000000.0 / (static_cast<float>(period_us) * RPM_MARKS_PER_REV) * filter.config.blades;
+    hz = fmodf(hz, filter.fs);
+    return hz > filter.fs / 2.0 ? filter.fs - hz : hz;
+}
+
+// Move the notch along with the live rpm, it is bypassed where it would cut into the signal itself
+void filter_track(ChannelFilter &filter, uint32_t now_us, float y) {
+    if (static_cast<int32_t>(now_us - filter.next_track_us) < 0) return;
+    filter.next_track_us = now_us + FILTER_TRACK_MS * 1000;
+
+    float target_hz = filter_blade_pass_hz(filter, now_us);
+    if (target_hz < FILTER_MIN_HZ || target_hz > FILTER_MAX_REL_HZ * filter.fs) {
+        filter.notch_hz = 0.0;
+        return;
+    }
+    if (filter.notch_hz == 0.0) {
+        filter.notch_hz = target_hz;
+        filter.notch.set_notch(filter.notch_hz, filter.fs, filter.config.notch_q);
+        filter.notch.reset(y);
+        return;
     }
-    return sum / static_cast<float>(MEASURE_AVERAGE_N * 5);
+    filter.notch_hz += FILTER_TRACK_GAIN * (target_hz - filter.notch_hz);
+    filter.notch.set_notch(filter.notch_hz, filter.fs, filter.config.notch_q);
 }
 
-// Measure thrust
-float measure_thrust() {
-    float sum = 0.0;
-    for (int i = 0; i < MEASURE_AVERAGE_N; i++) {
-        sum += scale.get_units();
-        delay(MEASURE_DELAY_MS);
+// Run one sample through the low-pass cascade and the notch of a channel
+float filter_process(ChannelFilter &filter, float x, uint32_t now_us) {
+    if (filter.update.load(std::memory_order_acquire)) {
+        portENTER_CRITICAL(&filter_mux);
+        filter.config = filter.pending;
+        filter.update.store(false, std::memory_order_relaxed);
+        portEXIT_CRITICAL(&filter_mux);
+
+        for (int i = 0; i < FILTER_LOWPASS_STAGES; i++) {
+            filter.lowpass[i].set_lowpass(filter.config.lowpass_hz, filter.fs, butterworth_q[i]);
+        }
+        filter.notch_hz = 0.0;
+        filter.next_track_us = now_us;
+        filter.primed = false;
+    }
+
+    float y = x;
+    if (filter.config.lowpass_hz > 0.0) {
+        for (int i = 0; i < FILTER_LOWPASS_STAGES; i++) {
+            if (!filter.primed) filter.lowpass[i].reset(x);
+            y = filter.lowpass[i].process(y);
+        }
+    }
+    filter.primed = true;
+
+    if (filter.config.notch) {
+        filter_track(filter, now_us, y);
+        if (filter.notch_hz > 0.0) y = filter.notch.process(y);
     }
-    return sum / static_cast<float>(MEASURE_AVERAGE_N);
+    return y;
 }
 
-// Measure voltage
-float measure_voltage() {
-    float sum = 0.0;
-    for (int i = 0; i < MEASURE_AVERAGE_N; i ++) {
-        sum += static_cast<float>(analogRead(BAT_VOLTAGE_PIN)) * (3.3 / 4095.0) * BAT_VOLTAGE_SCALE;
-        delay(MEASURE_DELAY_MS);
+// Sample the current and voltage channels on every tick of the ADC timer
+void adc_task(void *param) {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        StageTimer timer(STAGE_ADC_SAMPLE);
+        AdcSample sample;
+        sample.ts_us = micros();
+        sample.current_raw = analogRead(CURRENT_AOUT_PIN);
+        sample.voltage_raw = analogRead(BAT_VOLTAGE_PIN);
+        float current = filter_process(current_filter, current_lut[sample.current_raw], sample.ts_us);
+        sample.current_filtered = lroundf(current * (1 << FILTER_FRAC_BITS));
+        adc_samples.push(sample);
+        if (capture.recording(sample.ts_us)) {
+            capture.adc.push({sample.ts_us, current_lut[sample.current_raw], voltage_lut[sample.voltage_raw]});
+        }
     }
-    return sum / static_cast<float>(MEASURE_AVERAGE_N);
 }
 
-// Set throttle
-void set_throttle(float throttle) {
-    int esc_value = map(static_cast<int>(throttle * 100.0), 0, 100, 0, 180);
-    esc.write(esc_value);
-}
-
-// Handle all the measurements
-void measure(int current_step, int total_steps, float throttle_scale = 1.0) {
-    float throttle = static_cast<float>(current_step) / static_cast<float>(total_steps);
-    set_throttle(throttle * throttle_scale);
-    delay(1000);
-
-    measurements[current_step].throttle = static_cast<int>(throttle * 100);
-    measurements[current_step].rpm =      measure_rpm();
-    measurements[current_step].current =  measure_current(current_offset);
-    measurements[current_step].thrust =   measure_thrust();
-    measurements[current_step].voltage =  measure_voltage();
-
-    // Soft 100% throttle ramp-down
-    if (throttle == 1.0) {
-        set_throttle(0.75);
-        delay(300);
-        set_throttle(0.5);
-        delay(300);
-        set_throttle(0.25);
-        delay(300);
-    }
-}
-
-// Handle system initialization
-bool sys_init() {
-    const float max_rpm = 60.0;
-    const float max_current = 5.0;
-    const float min_voltage = 3.0;
-    const float max_thrust = 1.0;
-
-    if (measure_rpm() > max_rpm) {
-        digitalWrite(LED_GREEN_PIN, LOW);
-        is_gled_on = false;
-        /* Pattern start */
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        /* Pattern end */
-        digitalWrite(LED_GREEN_PIN, HIGH);
-        is_gled_on = true;
-
-        return false;
-    }
-    if (measure_current(current_offset) > max_current) {
-        digitalWrite(LED_GREEN_PIN, LOW);
-        is_gled_on = false;
-        /* Pattern start */
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        /* Pattern end */
-        digitalWrite(LED_GREEN_PIN, HIGH);
-        is_gled_on = true;
-
-        return false;
-    }
-    if (measure_voltage() < min_voltage) {
-        digitalWrite(LED_GREEN_PIN, LOW);
-        is_gled_on = false;
-        /* Pattern start */
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        /* Pattern end */
-        digitalWrite(LED_GREEN_PIN, HIGH);
-        is_gled_on = true;
-
-        return false;
-    }
-    if (measure_thrust() > max_thrust) {
-        digitalWrite(LED_GREEN_PIN, LOW);
-        is_gled_on = false;
-        /* Pattern start */
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        /* Pattern end */
-        digitalWrite(LED_GREEN_PIN, HIGH);
-        is_gled_on = true;
+void adc_sampler_begin() {
+    xTaskCreatePinnedToCore(adc_task, "adc", 2048, nullptr, ADC_TASK_PRIORITY, &adc_task_handle, ADC_TASK_CORE);
+    adc_start_us = micros();
+
+    adc_timer = timerBegin(ADC_TIMER_ID, 80, true);  // 1 MHz tick
+    timerAttachInterrupt(adc_timer, adc_timer_isr, true);
+    timerAlarmWrite(adc_timer, 1000000 / ADC_SAMPLE_RATE_HZ, true);
+    timerAlarmEnable(adc_timer);
+}
 
-        return false;
+// Clock the 24-bit two's complement word out of the HX711, then select the next conversion
+int32_t thrust_read_raw() {
+    uint32_t value = 0;
+    // SCK must not stay high for more than 60 us, or the HX711 powers down
+    portENTER_CRITICAL(&thrust_mux);
+    for (int i = 0; i < 24 + THRUST_GAIN_PULSES; i++) {
+        digitalWrite(THRUST_SCK_PIN, HIGH);
+        delayMicroseconds(1);
+        if (i < 24) value = (value << 1) | digitalRead(THRUST_DT_PIN);
+        digitalWrite(THRUST_SCK_PIN, LOW);
+        delayMicroseconds(1);
     }
-    if (system_paused) {
-        digitalWrite(LED_GREEN_PIN, LOW);
-        is_gled_on = false;
-        /* Pattern start */
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        digitalWrite(LED_YELLOW_PIN, HIGH);
-        delay(250);
-        digitalWrite(LED_YELLOW_PIN, LOW);
-        delay(100);
-        /* Pattern end */
-        digitalWrite(LED_GREEN_PIN, HIGH);
-        is_gled_on = true;
+    portEXIT_CRITICAL(&thrust_mux);
+
+    if (value & 0x800000) value |= 0xFF000000;
+    return static_cast<int32_t>(value);
+}
 
-        return false;
+// Read the HX711 whenever it signals data ready
+void thrust_task(void *param) {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(THRUST_READY_TIMEOUT_MS));
+        if (digitalRead(THRUST_DT_PIN) == LOW) {
+            StageTimer timer(STAGE_THRUST_READ);
+            ThrustSample sample;
+            sample.ts_us = micros();
+            sample.raw = thrust_read_raw();
+            sample.filtered = lroundf(filter_process(thrust_filter, sample.raw, sample.ts_us));
+            thrust_samples.push(sample);
+            if (capture.recording(sample.ts_us)) capture.thrust.push({sample.ts_us, sample.raw});
+        }
+        gpio_intr_enable(static_cast<gpio_num_t>(THRUST_DT_PIN));
     }
+}
+
+void thrust_sampler_begin() {
+    xTaskCreatePinnedToCore(thrust_task, "thrust", 2048, nullptr, THRUST_TASK_PRIORITY, &thrust_task_handle, THRUST_TASK_CORE);
+    thrust_start_us = micros();
+    attachInterrupt(digitalPinToInterrupt(THRUST_DT_PIN), thrust_ready_isr, FALLING);
+}
 
-    // Calibrate one more time
-    current_offset = -measure_current();
-    scale.tare();
+// Build one DShot frame: 11-bit value, telemetry request bit and 4-bit checksum (inverted for bidirectional DShot)
+void dshot_encode(uint16_t value, rmt_item32_t *items) {
+    uint16_t frame = value << 1;
+    uint16_t crc = (frame ^ (frame >> 4) ^ (frame >> 8)) & 0x0F;
+    if (ESC_DSHOT_BIDIR) crc = ~crc & 0x0F;
+    frame = (frame << 4) | crc;
 
-    return true;
+    for (int i = 0; i < 16; i++) {
+        uint32_t high_ticks = frame & (0x8000 >> i) ? DSHOT_T1H_TICKS : DSHOT_T0H_TICKS;
+        // The bidirectional signal is inverted, idling high
+        items[i].level0 = ESC_DSHOT_BIDIR ? 0 : 1;
+        items[i].duration0 = high_ticks;
+        items[i].level1 = ESC_DSHOT_BIDIR ? 1 : 0;
+        items[i].duration1 = DSHOT_BIT_TICKS - high_ticks;
+    }
 }
 
-//
-// Setup
-//
+// Decode an eRPM reply from the level runs captured by the RMT. Return false if it is not valid,
+// otherwise period_us is the electrical period, 0 with the motor stopped.
+bool dshot_decode(const rmt_item32_t *items, size_t n_items, uint32_t &period_us) {
+    // Every edge is a 1 of the 21-bit word (start bit and 20 GCR bits), the bit times between edges are 0s
+    uint32_t value = 0;
+    int bits = 0;
+    for (size_t i = 0; i < n_items && bits < 21; i++) {
+        uint32_t durations[2] = {items[i].duration0, items[i].duration1};
+        for (int h = 0; h < 2 && bits < 21; h++) {
+            int len = (durations[h] + DSHOT_REPLY_BIT_TICKS / 2) / DSHOT_REPLY_BIT_TICKS;
+            // The last run reaches into the idle line
+            if (durations[h] == 0 || bits + len > 21) len = 21 - bits;
+            if (len < 1) return false;
+            value = (value << len) | (1 << (len - 1));
+            bits += len;
+        }
+    }
+    if (bits != 21) return false;
 
-void setup() {
-    Serial.begin(115200);
+    uint32_t decoded = 0;
+    for (int i = 0; i < 4; i++) {
+        decoded |= dshot_gcr[(value >> (5 * i)) & 0x1F] << (4 * i);
+    }
+    uint32_t csum = decoded ^ (decoded >> 8);
+    csum ^= csum >> 4;
+    if ((csum & 0x0F) != 0x0F) return false;
 
-    // Safty switch setup
-    pinMode(SAFETY_SWITCH_PIN, INPUT);
-    attachInterrupt(digitalPinToInterrupt(SAFETY_SWITCH_PIN), system_pause_isr, FALLING);
-    
-    // RPM measurement setup
-    attachInterrupt(digitalPinToInterrupt(RPM_DOUT_PIN), rpm_counting_isr, RISING);
+    decoded >>= 4;
+    if (decoded == 0x0FFF) {
+        period_us = 0;
+        return true;
+    }
+    period_us = (decoded & 0x1FF) << (decoded >> 9);
+    return period_us > 0;
+}
 
-    // Current measurement setup
-    pinMode(CURRENT_AOUT_PIN, INPUT);
-    current_offset = -measure_current();
+// Feed the RPM channel from the telemetry, laying out edges at the reported period as the IR sensor would see them
+void dshot_rpm_edges(uint32_t now_us, uint32_t period_us) {
+    if (period_us == 0) {
+        dshot_spinning = false;
+        return;
+    }
+    uint32_t edge_period_us = period_us * (ESC_MOTOR_POLES / 2) / RPM_MARKS_PER_REV;
+    if (!dshot_spinning) {
+        dshot_next_edge_us = now_us;
+        dshot_spinning = true;
+    }
+    while (static_cast<int32_t>(now_us - dshot_next_edge_us) >= 0) {
+        rpm_period_us = edge_period_us;
+        rpm_last_edge_us = dshot_next_edge_us;
+        rpm_edges.push(dshot_next_edge_us);
+        if (capture.recording(dshot_next_edge_us)) capture.rpm.push(dshot_next_edge_us);
+        dshot_next_edge_us += edge_period_us;
+    }
+}
 
-    // Thrust measurement setup
-    scale.begin(THRUST_DT_PIN, THRUST_SCK_PIN);
-    scale.set_scale(THRUST_SCALE);
-    scale.tare();
+// Send a DShot frame on every tick of the ESC timer, after taking in the reply to the previous one
+void esc_task(void *param) {
+    rmt_item32_t items[16];
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        StageTimer timer(STAGE_ESC_FRAME);
+        if (ESC_DSHOT_BIDIR) {
+            rmt_rx_stop(ESC_RMT_RX_CHANNEL);
+            size_t size = 0;
+            void *reply;
+            while ((reply = xRingbufferReceive(dshot_rx_buffer, &size, 0)) != nullptr) {
+                uint32_t period_us;
+                if (dshot_decode(static_cast<rmt_item32_t *>(reply), size / sizeof(rmt_item32_t), period_us)) {
+                    dshot_rpm_edges(micros(), period_us);
+                }
+                vRingbufferReturnItem(dshot_rx_buffer, reply);
+            }
+        }
 
-    // Voltage measurement setup
-    pinMode(BAT_VOLTAGE_PIN, INPUT);
+        dshot_encode(dshot_value.load(std::memory_order_relaxed), items);
+        rmt_write_items(ESC_RMT_TX_CHANNEL, items, 16, true);
+        // The ESC replies about 30 us after the frame
+        if (ESC_DSHOT_BIDIR) rmt_rx_start(ESC_RMT_RX_CHANNEL, true);
+    }
+}
 
-    // ESC communication setup
-    pinMode(ESC_COMMAND_PIN, OUTPUT);
-    esc.attach(ESC_COMMAND_PIN, 1100, 1940);
-    set_throttle(0.0);
+// Set up the throttle output, LEDC pulses or DShot frames sent by esc_task()
+void esc_begin() {
+    if (ESC_PROTOCOL != ESC_PROTOCOL_DSHOT600) {
+        const EscTiming &timing = esc_timings[ESC_PROTOCOL];
+        ledcSetup(ESC_LEDC_CHANNEL, timing.freq_hz, timing.bits);
+        ledcAttachPin(ESC_COMMAND_PIN, ESC_LEDC_CHANNEL);
+        return;
+    }
 
-    // LEDs setup
-    pinMode(LED_GREEN_PIN, OUTPUT);
-    pinMode(LED_YELLOW_PIN, OUTPUT);
-    digitalWrite(LED_GREEN_PIN, HIGH);
-    digitalWrite(LED_YELLOW_PIN, LOW);
-    standby_ts = millis();
+    gpio_num_t pin = static_cast<gpio_num_t>(ESC_COMMAND_PIN);
+    if (ESC_DSHOT_BIDIR) {
+        rmt_config_t rx_config = RMT_DEFAULT_CONFIG_RX(pin, ESC_RMT_RX_CHANNEL);
+        rx_config.clk_div = 1;
+        rx_config.rx_config.idle_threshold = DSHOT_RX_IDLE_TICKS;
+        rx_config.rx_config.filter_en = true;
+        rx_config.rx_config.filter_ticks_thresh = DSHOT_RX_FILTER_TICKS;
+        rmt_config(&rx_config);
+        rmt_driver_install(ESC_RMT_RX_CHANNEL, 1024, 0);
+        rmt_get_ringbuf_handle(ESC_RMT_RX_CHANNEL, &dshot_rx_buffer);
+    }
+    rmt_config_t tx_config = RMT_DEFAULT_CONFIG_TX(pin, ESC_RMT_TX_CHANNEL);
+    tx_config.clk_div = 1;
+    tx_config.tx_config.idle_output_en = true;
+    tx_config.tx_config.idle_level = ESC_DSHOT_BIDIR ? RMT_IDLE_LEVEL_HIGH : RMT_IDLE_LEVEL_LOW;
+    rmt_config(&tx_config);
+    rmt_driver_install(ESC_RMT_TX_CHANNEL, 0, 0);
+    if (ESC_DSHOT_BIDIR) {
+        // Both channels share the pin: driven open drain, so the ESC can pull it low for its reply
+        gpio_set_direction(pin, GPIO_MODE_INPUT_OUTPUT_OD);
+        gpio_pullup_en(pin);
+    }
+
+    xTaskCreatePinnedToCore(esc_task, "esc", 2048, nullptr, ESC_TASK_PRIORITY, &esc_task_handle, ESC_TASK_CORE);
+    esc_timer = timerBegin(ESC_TIMER_ID, 80, true);  // 1 MHz tick
+    timerAttachInterrupt(esc_timer, esc_timer_isr, true);
+    timerAlarmWrite(esc_timer, 1000000 / ESC_DSHOT_RATE_HZ, true);
+    timerAlarmEnable(esc_timer);
+}
+
+// Output a throttle from 0 to 1 to the ESC
+void esc_write(float throttle) {
+    if (ESC_PROTOCOL == ESC_PROTOCOL_DSHOT600) {
+        dshot_value = throttle > 0.0 ? 48 + lroundf(throttle * 1999.0) : 0;
+        return;
+    }
+    const EscTiming &timing = esc_timings[ESC_PROTOCOL];
+    float pulse_us = timing.min_us + throttle * (timing.max_us - timing.min_us);
+    float ticks_per_us = timing.freq_hz * static_cast<float>(1 << timing.bits) / 1000000.0;
+    ledcWrite(ESC_LEDC_CHANNEL, lroundf(pulse_us * ticks_per_us));
 }
 
 //
-// Loop
+// LEDs
 //
 
-void loop() {
-    if (Serial.available() > 0) {
-        StaticJsonDocument<512> command_doc;
-        deserializeJson(command_doc, Serial);
-        JsonObject command_obj = command_doc.as<JsonObject>();
-
-        if (!command_obj.containsKey("command_type")) return;
-
-        if (command_obj["command_type"] == "sys_init") {
-            StaticJsonDocument<128> return_doc;
-            bool is_sys_ok = sys_init();
-
-            return_doc["response_type"] = "sys_init";
-            return_doc["ok"] = is_sys_ok;
-            serializeJson(return_doc, Serial);
-            Serial.print("\n");
-
-            digitalWrite(LED_GREEN_PIN, LOW);
-            is_gled_on = false;
-            /* Pattern start */
-            delay(100);
-            digitalWrite(LED_YELLOW_PIN, HIGH);
-            delay(250);
-            digitalWrite(LED_YELLOW_PIN, LOW);
-            delay(100);
-            digitalWrite(LED_YELLOW_PIN, HIGH);
-            delay(250);
-            digitalWrite(LED_YELLOW_PIN, LOW);
-            delay(100);
-            /* Pattern end */
-            digitalWrite(LED_GREEN_PIN, HIGH);
-            is_gled_on = true;
-        }
-        else if (command_obj["command_type"] == "measure") {
-            StaticJsonDocument<3072> return_doc;
-            int steps = command_obj["steps"];
-            float throttle_scale = command_obj["throttle_scale"];
-            for (int i = 0; i <= steps; i++) {
-                if (!system_paused) {
-                    measure(i, steps, throttle_scale);
-
-                    digitalWrite(LED_GREEN_PIN, LOW);
-                    is_gled_on = false;
-                    /* Pattern start */
-                    delay(100);
-                    digitalWrite(LED_YELLOW_PIN, HIGH);
-                    delay(250);
-                    digitalWrite(LED_YELLOW_PIN, LOW);
-                    delay(100);
-                    /* Pattern end */
-                    digitalWrite(LED_GREEN_PIN, HIGH);
-                    is_gled_on = true;
-                }
-                else {
-                    set_throttle(0.0);
+// Queue a pattern of yellow blinks with the green LED off, played by led_task() without blocking
+void led_pattern(int blinks) {
+    if (led_state == LED_FAULT || led_queue_len >= LED_QUEUE_SIZE) return;
+    led_queue[led_queue_len++] = blinks;
+}
 
-                    delay(100);
-                    digitalWrite(LED_GREEN_PIN, LOW);
-                    digitalWrite(LED_YELLOW_PIN, HIGH);
-                    is_gled_on = false;
-                    
-                    break;
-                }
-                set_throttle(0.0);
-            }
+// Keep the green LED off and the yellow LED on
+void led_fault() {
+    led_state = LED_FAULT;
+    led_queue_len = 0;
+    digitalWrite(LED_GREEN_PIN, LOW);
+    digitalWrite(LED_YELLOW_PIN, HIGH);
+    is_gled_on = false;
+}
 
-            return_doc["response_type"] = "measure";
-            return_doc["ok"] = !system_paused;
-            JsonArray data_array = return_doc.createNestedArray("data");
-            for (int i = 0; i <= steps; i++) {
-                JsonObject data = data_array.createNestedObject();
-                data["throttle"] = measurements[i].throttle;
-                data["rpm"] =      measurements[i].rpm;
-                data["current"] =  measurements[i].current;
-                data["thrust"] =   measurements[i].thrust;
-                data["voltage"] =  measurements[i].voltage;
+void led_task() {
+    unsigned long now = millis();
+    switch (led_state) {
+        case LED_STANDBY:
+            if (led_queue_len > 0) {
+                led_blinks_left = led_queue[0];
+                led_queue_len--;
+                memmove(led_queue, led_queue + 1, led_queue_len * sizeof(led_queue[0]));
+                digitalWrite(LED_GREEN_PIN, LOW);
+                is_gled_on = false;
+                led_state = LED_LEAD;
+                led_ts = now;
             }
-            serializeJson(return_doc, Serial);
-            Serial.print("\n");
-
-            if (system_paused) {
-                while (true) {}
+            else if (now - standby_ts > LED_STANDBY_MS) {
+                digitalWrite(LED_GREEN_PIN, is_gled_on ? LOW : HIGH);
+                is_gled_on = !is_gled_on;
+                standby_ts = now;
             }
+            break;
+        case LED_LEAD:
+            if (now - led_ts >= LED_GAP_MS) {
+                digitalWrite(LED_YELLOW_PIN, HIGH);
+                led_state = LED_BLINK_ON;
+                led_ts = now;
+            }
+            break;
+        case LED_BLINK_ON:
+            if (now - led_ts >= LED_BLINK_MS) {
+                digitalWrite(LED_YELLOW_PIN, LOW);
+                led_blinks_left--;
+                led_state = LED_BLINK_OFF;
+                led_ts = now;
+            }
+            break;
+        case LED_BLINK_OFF:
+            if (now - led_ts >= LED_GAP_MS) {
+                if (led_blinks_left > 0) {
+                    digitalWrite(LED_YELLOW_PIN, HIGH);
+                    led_state = LED_BLINK_ON;
+                }
+                else {
+                    digitalWrite(LED_GREEN_PIN, HIGH);
+                    is_gled_on = true;
+                    led_state = LED_STANDBY;
+                }
+                led_ts = now;
+            }
+            break;
+        case LED_FAULT:
+            break;
+    }
+}
+
+//
+// Functions
+//
+
+// Fill the lookup table of one ADC unit from its characterization, correcting the non-linearity of the ADC
+esp_adc_cal_value_t adc_characterize(adc_unit_t unit, uint16_t *lut) {
+    esp_adc_cal_characteristics_t characteristics;
+    esp_adc_cal_value_t source = esp_adc_cal_characterize(unit, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12,
+                                                          ADC_DEFAULT_VREF_MV, &characteristics);
+    for (uint32_t raw = 0; raw < ADC_LUT_SIZE; raw++) {
+        lut[raw] = esp_adc_cal_raw_to_voltage(raw, &characteristics);
+    }
+    return source;
+}
+
+// Characterize the ADC units of the current (ADC2) and voltage (ADC1) channels
+void adc_calibrate() {
+    calibration.current_cal = adc_characterize(ADC_UNIT_2, current_lut);
+    calibration.voltage_cal = adc_characterize(ADC_UNIT_1, voltage_lut);
+}
+
+// Convert ADC millivolts to Amp, without offset
+float adc_to_current(float mv) {
+    return mv * 0.001 * calibration.current_scale;
+}
+
+// Convert ADC millivolts to volt
+float adc_to_voltage(float mv) {
+    return mv * 0.001 * calibration.voltage_scale;
+}
+
+// Convert the statistics of raw samples with a linear conversion, plus an offset
+ChannelStats channel_stats(const RunningStats &raw, float (*convert)(float), float offset = 0.0) {
+    ChannelStats stats;
+    stats.n = raw.n;
+    if (raw.n == 0) return stats;
+    stats.std = fabsf(convert(raw.stddev()) - convert(0.0));
+    stats.min = convert(raw.min) + offset;
+    stats.max = convert(raw.max) + offset;
+    return stats;
+}
+
+// Average the buffered ADC samples taken in [from_us, to_us) in millivolts, return the number of samples
+// The readings are linearized through the lookup tables, current is taken after its filter stage. The statistics of the samples are collected as well when asked for
+uint32_t adc_window(uint32_t from_us, uint32_t to_us, float &current_mv, float &voltage_mv,
+                    RunningStats *current_stats = nullptr, RunningStats *voltage_stats = nullptr) {
+    const float current_unit = 1.0 / (1 << FILTER_FRAC_BITS);
+    int64_t current_sum = 0;
+    uint32_t voltage_sum = 0;
+    uint32_t n = 0;
+
+    uint32_t head = adc_samples.head.load(std::memory_order_acquire);
+    uint32_t available = min(head, static_cast<uint32_t>(ADC_BUFFER_SIZE - 1));
+    for (uint32_t i = 0; i < available; i++) {
+        const AdcSample &sample = adc_samples.recent(i, head);
+        if (static_cast<int32_t>(sample.ts_us - to_us) >= 0) continue;
+        if (static_cast<int32_t>(sample.ts_us - from_us) < 0) break;
+        current_sum += sample.current_filtered;
+        voltage_sum += voltage_lut[sample.voltage_raw];
+        if (current_stats) current_stats->add(sample.current_filtered * current_unit);
+        if (voltage_stats) voltage_stats->add(voltage_lut[sample.voltage_raw]);
+        n++;
+    }
+
+    current_mv = n > 0 ? static_cast<float>(current_sum) * current_unit / n : 0.0;
+    voltage_mv = n > 0 ? static_cast<float>(voltage_sum) / n : 0.0;
+    return n;
+}
+
+// Average the buffered ADC samples taken in [from_us, to_us) in millivolts before the current filter, for the
+// real time limits: a low cutoff would delay a trip by its settling time. Return the number of samples
+uint32_t adc_window_unfiltered(uint32_t from_us, uint32_t to_us, float &current_mv, float &voltage_mv) {
+    uint32_t current_sum = 0;
+    uint32_t voltage_sum = 0;
+    uint32_t n = 0;
+
+    uint32_t head = adc_samples.head.load(std::memory_order_acquire);
+    uint32_t available = min(head, static_cast<uint32_t>(ADC_BUFFER_SIZE - 1));
+    for (uint32_t i = 0; i < available; i++) {
+        const AdcSample &sample = adc_samples.recent(i, head);
+        if (static_cast<int32_t>(sample.ts_us - to_us) >= 0) continue;
+        if (static_cast<int32_t>(sample.ts_us - from_us) < 0) break;
+        current_sum += current_lut[sample.current_raw];
+        voltage_sum += voltage_lut[sample.voltage_raw];
+        n++;
+    }
+
+    current_mv = n > 0 ? static_cast<float>(current_sum) / n : 0.0;
+    voltage_mv = n > 0 ? static_cast<float>(voltage_sum) / n : 0.0;
+    return n;
+}
+
+// Average the latest window_ms of ADC samples, waiting only if the sampler has not run that long yet
+uint32_t adc_recent(unsigned long window_ms, float &current_mv, float &voltage_mv) {
+    unsigned long window_us = window_ms * 1000;
+    unsigned long running_us = micros() - adc_start_us;
+    if (running_us < window_us) {
+        delay((window_us - running_us) / 1000 + 1);
+    }
+    uint32_t now_us = micros();
+    return adc_window(now_us - window_us, now_us, current_mv, voltage_mv);
+}
+
+// Average the periods between the RPM edges in [from_us, to_us)
+// When the window holds fewer than RPM_MIN_EDGES edges, older edges (up to RPM_TIMEOUT_MS) are used as well
+// The statistics of the rpm of every single period are collected as well when asked for
+float rpm_window(uint32_t from_us, uint32_t to_us, RunningStats *stats = nullptr) {
+    const uint32_t timeout_us = RPM_TIMEOUT_MS * 1000;
+    uint32_t head = rpm_edges.head.load(std::memory_order_acquire);
+    uint32_t available = min(head, static_cast<uint32_t>(RPM_BUFFER_SIZE - 1));
+
+    uint32_t newest_us = 0;
+    uint32_t oldest_us = 0;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < available; i++) {
+        uint32_t edge_us = rpm_edges.recent(i, head);
+        if (static_cast<int32_t>(edge_us - to_us) >= 0) continue;
+        if (n == 0 && to_us - edge_us > timeout_us) break;
+        bool in_window = static_cast<int32_t>(edge_us - from_us) >= 0;
+        if (!in_window && (n >= RPM_MIN_EDGES || to_us - edge_us > timeout_us)) break;
+        if (n == 0) newest_us = edge_us;
+        if (stats && n > 0 && oldest_us != edge_us) {
+            stats->add(60.0 * 1000000.0 / (static_cast<float>(oldest_us - edge_us) * RPM_MARKS_PER_REV));
+        }
+        oldest_us = edge_us;
+        n++;
+    }
+
+    if (n < 2 || newest_us == oldest_us) return 0.0;
+    float period_us = static_cast<float>(newest_us - oldest_us) / static_cast<float>(n - 1);
+    return 60.0 * 1000000.0 / (period_us * RPM_MARKS_PER_REV);
+}
+
+// Measure current
+float measure_current(float offset = 0.0) {
+    float current_mv, voltage_mv;
+    adc_recent(CURRENT_WINDOW_MS, current_mv, voltage_mv);
+    return adc_to_current(current_mv) + offset;
+}
+
+// Convert HX711 readings to kilogram, with the tare offset and calibration.thrust_scale held by the HX711 library
+float thrust_to_kg(float raw) {
+    return (raw - static_cast<float>(scale.get_offset())) / scale.get_scale();
+}
+
+// Average the buffered HX711 readings taken in [from_us, to_us) after the thrust filter, return the number of readings
+uint32_t thrust_window(uint32_t from_us, uint32_t to_us, float &raw, RunningStats *stats = nullptr) {
+    int64_t sum = 0;
+    uint32_t n = 0;
+
+    uint32_t head = thrust_samples.head.load(std::memory_order_acquire);
+    uint32_t available = min(head, static_cast<uint32_t>(THRUST_BUFFER_SIZE - 1));
+    for (uint32_t i = 0; i < available; i++) {
+        const ThrustSample &sample = thrust_samples.recent(i, head);
+        if (static_cast<int32_t>(sample.ts_us - to_us) >= 0) continue;
+        if (static_cast<int32_t>(sample.ts_us - from_us) < 0) break;
+        sum += sample.filtered;
+        if (stats) stats->add(sample.filtered);
+        n++;
+    }
+
+    raw = n > 0 ? static_cast<float>(sum) / n : 0.0;
+    return n;
+}
+
+// Thrust in kg averaged over [from_us, to_us), or the latest reading if the window holds none
+float thrust_kg(uint32_t from_us, uint32_t to_us) {
+    float raw;
+    if (thrust_window(from_us, to_us, raw) == 0) {
+        uint32_t head = thrust_samples.head.load(std::memory_order_acquire);
+        if (head == 0) return 0.0;
+        raw = thrust_samples.recent(0, head).filtered;
+    }
+    return thrust_to_kg(raw);
+}
+
+// Thrust in kg of the HX711 readings in [from_us, to_us) before the thrust filter, or of the latest reading,
+// for the real time limits
+float thrust_kg_unfiltered(uint32_t from_us, uint32_t to_us) {
+    int64_t sum = 0;
+    uint32_t n = 0;
+
+    uint32_t head = thrust_samples.head.load(std::memory_order_acquire);
+    if (head == 0) return 0.0;
+    uint32_t available = min(head, static_cast<uint32_t>(THRUST_BUFFER_SIZE - 1));
+    for (uint32_t i = 0; i < available; i++) {
+        const ThrustSample &sample = thrust_samples.recent(i, head);
+        if (static_cast<int32_t>(sample.ts_us - to_us) >= 0) continue;
+        if (static_cast<int32_t>(sample.ts_us - from_us) < 0) break;
+        sum += sample.raw;
+        n++;
+    }
+
+    float raw = n > 0 ? static_cast<float>(sum) / n : thrust_samples.recent(0, head).raw;
+    return thrust_to_kg(raw);
+}
+
+// Average the latest window_ms of HX711 readings, waiting only if the sampler has not run that long yet
+uint32_t thrust_recent(unsigned long window_ms, float &raw) {
+    unsigned long window_us = window_ms * 1000;
+    unsigned long running_us = micros() - thrust_start_us;
+    if (running_us < window_us) {
+        delay((window_us - running_us) / 1000 + 1);
+    }
+    uint32_t now_us = micros();
+    return thrust_window(now_us - window_us, now_us, raw);
+}
+
+// Zero the load cell with the latest buffered readings
+void thrust_tare() {
+    float raw;
+    if (thrust_recent(THRUST_TARE_MS, raw) > 0) {
+        scale.set_offset(lroundf(raw));
+    }
+}
+
+// Reduce the buffered samples of every channel in [from_us, to_us) into the values and statistics of m
+// With hold_thrust, the latest HX711 reading is used when the window is shorter than its conversion period
+void reduce_window(uint32_t from_us, uint32_t to_us, Measurements &m, bool hold_thrust) {
+    StageTimer timer(STAGE_REDUCE);
+    RunningStats rpm_stats, thrust_stats, current_stats, voltage_stats;
+    float current_mv, voltage_mv, thrust_raw;
+    uint32_t adc_n = adc_window(from_us, to_us, current_mv, voltage_mv, &current_stats, &voltage_stats);
+    uint32_t thrust_n = thrust_window(from_us, to_us, thrust_raw, &thrust_stats);
+
+    m.rpm =     rpm_window(from_us, to_us, &rpm_stats);
+    m.current = adc_n > 0 ? adc_to_current(current_mv) + current_offset : 0.0;
+    m.voltage = adc_n > 0 ? adc_to_voltage(voltage_mv) : 0.0;
+    if (thrust_n > 0) {
+        m.thrust = thrust_to_kg(thrust_raw);
+    }
+    else {
+        m.thrust = hold_thrust ? thrust_kg(from_us, to_us) : 0.0;
+    }
+
+    m.rpm_stats.std = rpm_stats.stddev();
+    m.rpm_stats.min = rpm_stats.min;
+    m.rpm_stats.max = rpm_stats.max;
+    m.rpm_stats.n =   rpm_stats.n;
+    m.thrust_stats =  channel_stats(thrust_stats, thrust_to_kg);
+    m.current_stats = channel_stats(current_stats, adc_to_current, current_offset);
+    m.voltage_stats = channel_stats(voltage_stats, adc_to_voltage);
+}
+
+// Start sampling all the channels concurrently over one shared time window
+void acquire_begin(unsigned long window_ms = ACQUIRE_WINDOW_MS) {
+    acquisition.start_ts = millis();
+    acquisition.start_us = micros();
+    acquisition.window_ms = window_ms;
+}
+
+// Reduce the buffered samples of the window into m once it is over. Return true when done.
+bool acquire_poll(Measurements &m) {
+    unsigned long elapsed_ms = millis() - acquisition.start_ts;
+    if (elapsed_ms < acquisition.window_ms) return false;
+
+    reduce_window(acquisition.start_us, micros(), m, false);
+    m.timestamp = acquisition.start_ts + elapsed_ms / 2;
+    return true;
+}
+
+// Add one rpm and thrust reading to a settle window
+void settle_push(SettleWindow &window, float rpm, float thrust) {
+    window.rpm[window.n % SETTLE_WINDOW_N] = rpm;
+    window.thrust[window.n % SETTLE_WINDOW_N] = thrust;
+    window.n++;
+}
+
+// Whether both the drift (least squares slope over the window) and the deviation of a full window are within tol
+bool settle_steady(const float *values, int n, float tol) {
+    const float i_mean = (SETTLE_WINDOW_N - 1) / 2.0;
+    float mean = 0.0;
+    for (int i = 0; i < SETTLE_WINDOW_N; i++) {
+        mean += values[i];
+    }
+    mean /= SETTLE_WINDOW_N;
+
+    float var = 0.0;
+    float cov = 0.0;
+    float i_var = 0.0;
+    for (int i = 0; i < SETTLE_WINDOW_N; i++) {
+        float d = values[(n + i) % SETTLE_WINDOW_N] - mean;  // Oldest reading first
+        var += d * d;
+        cov += (i - i_mean) * d;
+        i_var += (i - i_mean) * (i - i_mean);
+    }
+    float drift = fabsf(cov / i_var) * (SETTLE_WINDOW_N - 1);
+    float deviation = sqrtf(var / SETTLE_WINDOW_N);
+    return drift <= tol && deviation <= tol;
+}
+
+bool settle_done(const SettleWindow &window, float rpm_tol, float thrust_tol) {
+    if (window.n < SETTLE_WINDOW_N) return false;
+
+    float rpm_mean = 0.0;
+    for (int i = 0; i < SETTLE_WINDOW_N; i++) {
+        rpm_mean += window.rpm[i];
+    }
+    rpm_mean /= SETTLE_WINDOW_N;
+
+    return settle_steady(window.rpm, window.n, max(rpm_mean * rpm_tol, static_cast<float>(SETTLE_RPM_FLOOR))) &&
+           settle_steady(window.thrust, window.n, thrust_tol);
+}
+
+// Set throttle, held at minimum once the safety has tripped
+void set_throttle(float throttle) {
+    // Keep safety_task() from tripping between the check and the write
+    vTaskSuspendAll();
+    if (system_paused) throttle = 0.0;
+    esc_write(throttle);
+    throttle_output = throttle;
+    xTaskResumeAll();
+}
+
+//
+// Capture
+//
+
+// Take the arena of one capture channel, from PSRAM when there is some
+template <typename T>
+void capture_alloc(ArenaRing<T> &ring, uint32_t len) {
+    uint32_t caps = MALLOC_CAP_SPIRAM;
+    if (!psramFound()) {
+        caps = MALLOC_CAP_8BIT;
+        len >>= CAPTURE_DRAM_SHIFT;
+    }
+    ring.mask = len - 1;
+    ring.items = static_cast<T *>(heap_caps_malloc(len * sizeof(T), caps));
+    if (ring.items == nullptr) ring.mask = 0;
+}
+
+// Allocate the capture before the samplers start recording into it
+void capture_begin() {
+    capture_alloc(capture.adc, CAPTURE_ADC_SAMPLES);
+    capture_alloc(capture.thrust, CAPTURE_THRUST_SAMPLES);
+    capture_alloc(capture.rpm, CAPTURE_RPM_EDGES);
+}
+
+// Record until end_us, then hold the capture. The first event wins until the capture is armed again.
+void capture_trigger(const char *event, uint32_t ts_us, uint32_t end_us) {
+    portENTER_CRITICAL(&capture_mux);
+    if (!capture.triggered.load(std::memory_order_relaxed)) {
+        capture.trigger = event;
+        capture.trigger_us = ts_us;
+        capture.end_us = end_us;
+        capture.triggered.store(true, std::memory_order_release);
+    }
+    portEXIT_CRITICAL(&capture_mux);
+}
+
+// Whether a triggered capture is complete and holds still
+bool capture_done(uint32_t now_us) {
+    if (!capture.triggered.load(std::memory_order_acquire)) return false;
+    return static_cast<int32_t>(now_us - capture.end_us) >= CAPTURE_SETTLE_MS * 1000;
+}
+
+// Drop what was captured and record again
+void capture_arm() {
+    capture.adc.start = capture.adc.head;
+    capture.thrust.start = capture.thrust.head;
+    capture.rpm.start = capture.rpm.head;
+    capture.watching = false;
+    portENTER_CRITICAL(&capture_mux);
+    capture.trigger = "none";
+    capture.triggered.store(false, std::memory_order_release);
+    portEXIT_CRITICAL(&capture_mux);
+}
+
+// Trigger the capture on a current spike, a jump of spike_a over the slow average of the current
+void capture_watch(uint32_t now_us) {
+    if (capture.spike_a <= 0.0 || capture.triggered) return;
+    float current_mv, voltage_mv;
+    if (adc_window_unfiltered(now_us - LIMIT_WINDOW_MS * 1000, now_us, current_mv, voltage_mv) == 0) return;
+
+    float current = adc_to_current(current_mv) + current_offset;
+    if (!capture.watching) {
+        capture.current_avg = current;
+        capture.watching = true;
+        return;
+    }
+    if (current - capture.current_avg > capture.spike_a) {
+        capture_trigger("spike", now_us, now_us + capture.post_ms * 1000);
+        return;
+    }
+    capture.current_avg += (current - capture.current_avg) * SAFETY_CHECK_MS / CAPTURE_SPIKE_TAU_MS;
+}
+
+//
+// Safety
+//
+
+// Cut the motor and keep the samples leading up to the first trip for the host
+void safety_trip(TripReason reason, uint32_t ts_us, float value) {
+    system_paused = true;
+    set_throttle(0.0);
+    if (trip.reason != TRIP_NONE) return;
+
+    trip.reason = reason;
+    trip.ts_us = ts_us;
+    trip.value = value;
+    if (capture.on_trip) capture_trigger(trip_names[reason], ts_us, ts_us + capture.post_ms * 1000);
+
+    uint32_t head = adc_samples.head.load(std::memory_order_acquire);
+    trip.n_adc = min(head, static_cast<uint32_t>(TRIP_ADC_SAMPLES));
+    for (int i = 0; i < trip.n_adc; i++) {
+        trip.adc[i] = adc_samples.recent(trip.n_adc - 1 - i, head);
+    }
+    head = thrust_samples.head.load(std::memory_order_acquire);
+    trip.n_thrust = min(head, static_cast<uint32_t>(TRIP_THRUST_SAMPLES));
+    for (int i = 0; i < trip.n_thrust; i++) {
+        trip.thrust[i] = thrust_samples.recent(trip.n_thrust - 1 - i, head);
+    }
+    trip_pending = true;
+}
+
+// Check the real time limits against the latest samples before the filters, return the first one exceeded
+TripReason safety_check(float &value) {
+    uint32_t now_us = micros();
+    uint32_t from_us = now_us - LIMIT_WINDOW_MS * 1000;
+
+    float current_mv, voltage_mv;
+    if (adc_window_unfiltered(from_us, now_us, current_mv, voltage_mv) > 0) {
+        value = adc_to_current(current_mv) + current_offset;
+        if (value > LIMIT_MAX_CURRENT) return TRIP_OVER_CURRENT;
+        value = adc_to_voltage(voltage_mv);
+        if (throttle_output > 0.0 && value < LIMIT_MIN_VOLTAGE) return TRIP_UNDER_VOLTAGE;
+    }
+    value = thrust_kg_unfiltered(from_us, now_us);
+    if (value > LIMIT_MAX_THRUST) return TRIP_OVER_THRUST;
+    return TRIP_NONE;
+}
+
+// Top priority task on the acquisition core, woken right away by the safety switch
+void safety_task(void *param) {
+    while (true) {
+        if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SAFETY_CHECK_MS)) > 0) {
+            safety_trip(TRIP_SWITCH, switch_trip_us, 0.0);
+            continue;
+        }
+        if (system_paused) continue;
+
+        StageTimer timer(STAGE_SAFETY_CHECK);
+        float value = 0.0;
+        TripReason reason = safety_check(value);
+        if (reason != TRIP_NONE) {
+            safety_trip(reason, micros(), value);
+        }
+        capture_watch(micros());
+    }
+}
+
+// Fill a json object with the statistics of one channel
+void write_channel_stats(JsonObject stats, const ChannelStats &c) {
+    stats["std"] = c.std;
+    stats["min"] = c.min;
+    stats["max"] = c.max;
+    stats["n"] =   c.n;
+}
+
+// Fill a json object with one step of measurements, with_stats adds the spread of every channel
+void write_measurements(JsonObject data, const Measurements &m, bool with_stats = false) {
+    data["throttle"] =  m.throttle;
+    data["rpm"] =       m.rpm;
+    data["current"] =   m.current;
+    data["thrust"] =    m.thrust;
+    data["voltage"] =   m.voltage;
+    data["timestamp"] = m.timestamp;
+    data["settle_ms"] = m.settle_ms;
+
+    if (!with_stats) return;
+    JsonObject stats = data.createNestedObject("stats");
+    write_channel_stats(stats.createNestedObject("rpm"),     m.rpm_stats);
+    write_channel_stats(stats.createNestedObject("thrust"),  m.thrust_stats);
+    write_channel_stats(stats.createNestedObject("current"), m.current_stats);
+    write_channel_stats(stats.createNestedObject("voltage"), m.voltage_stats);
+}
+
+// CRC-16/CCITT-FALSE
+uint16_t crc16(const uint8_t *data, size_t len) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= static_cast<uint16_t>(data[i]) << 8;
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Consistent overhead byte stuffing, the output holds no zero byte and is at most len + len / 254 + 1 long
+size_t cobs_encode(const uint8_t *in, size_t len, uint8_t *out) {
+    size_t code_i = 0;
+    size_t out_i = 1;
+    uint8_t code = 1;
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] == 0) {
+            out[code_i] = code;
+            code_i = out_i++;
+            code = 1;
+            continue;
+        }
+        out[out_i++] = in[i];
+        if (++code == 0xFF) {
+            out[code_i] = code;
+            code_i = out_i++;
+            code = 1;
+        }
+    }
+    out[code_i] = code;
+    return out_i;
+}
+
+// Send the payload already placed at frame_raw[1] as one binary frame
+void send_frame(uint8_t type, size_t payload_len) {
+    frame_raw[0] = type;
+    uint16_t crc = crc16(frame_raw, payload_len + 1);
+    frame_raw[payload_len + 1] = crc & 0xFF;
+    frame_raw[payload_len + 2] = crc >> 8;
+
+    size_t encoded_len;
+    {
+        StageTimer timer(STAGE_FRAME_ENCODE);
+        encoded_len = cobs_encode(frame_raw, payload_len + 3, frame_encoded);
+        frame_encoded[encoded_len++] = 0x00;
+    }
+    StageTimer timer(STAGE_SERIAL_WRITE);
+    Serial.write(frame_encoded, encoded_len);
+}
+
+// Send a json document to the host as one line, or as a FRAME_JSON in binary mode
+void send_json(const JsonDocument &doc) {
+    size_t len;
+    {
+        StageTimer timer(STAGE_SERIALIZE);
+        len = serializeJson(doc, reinterpret_cast<char *>(frame_raw + 1), FRAME_MAX_PAYLOAD);
+    }
+    if (protocol == PROTOCOL_BINARY) {
+        send_frame(FRAME_JSON, len);
+        return;
+    }
+    // Serialized into the frame buffer as well, so the write goes out in one piece
+    StageTimer timer(STAGE_SERIAL_WRITE);
+    frame_raw[len + 1] = '\n';
+    Serial.write(frame_raw + 1, len + 1);
+}
+
+// Send one streamed step, as a "<command>_step" json record or a FRAME_STEP / FRAME_RAMP_STEP in binary mode
+void send_step(CommandType command, int seq, const Measurements &m) {
+    if (protocol == PROTOCOL_BINARY) {
+        StepRecord record;
+        record.seq =       seq;
+        record.throttle =  m.throttle;
+        record.rpm =       m.rpm;
+        record.thrust =    m.thrust;
+        record.current =   m.current;
+        record.voltage =   m.voltage;
+        record.timestamp = m.timestamp;
+        record.settle_ms = min(m.settle_ms, 0xFFFFUL);
+        record.rpm_std =     m.rpm_stats.std;
+        record.rpm_min =     m.rpm_stats.min;
+        record.rpm_max =     m.rpm_stats.max;
+        record.thrust_std =  m.thrust_stats.std;
+        record.thrust_min =  m.thrust_stats.min;
+        record.thrust_max =  m.thrust_stats.max;
+        record.current_std = m.current_stats.std;
+        record.current_min = m.current_stats.min;
+        record.current_max = m.current_stats.max;
+        record.voltage_std = m.voltage_stats.std;
+        record.voltage_min = m.voltage_stats.min;
+        record.voltage_max = m.voltage_stats.max;
+        memcpy(frame_raw + 1, &record, sizeof(record));
+        send_frame(command == COMMAND_RAMP ? FRAME_RAMP_STEP : FRAME_STEP, sizeof(record));
+        return;
+    }
+    StaticJsonDocument<768> step_doc;
+    step_doc["response_type"] = command == COMMAND_RAMP ? "ramp_step" : "measure_step";
+    step_doc["seq"] = seq;
+    write_measurements(step_doc.createNestedObject("data"), m, true);
+    send_json(step_doc);
+}
+
+//
+// Storage
+//
+
+// Load the stored calibration, and the offsets unless they are stale. Return true if the offsets were loaded.
+bool storage_load() {
+    Preferences prefs;
+    prefs.begin(NVS_NAMESPACE, false);
+    boot_count = prefs.getUInt("boots", 0) + 1;
+    prefs.putUInt("boots", boot_count);
+    StoredCalibration stored;
+    bool found = prefs.getBytes("cal", &stored, sizeof(stored)) == sizeof(stored) && stored.version == NVS_VERSION;
+    prefs.end();
+    if (!found) return false;
+
+    calibration.current_scale = stored.current_scale;
+    calibration.voltage_scale = stored.voltage_scale;
+    calibration.thrust_scale = stored.thrust_scale;
+    if (boot_count - stored.boot > NVS_MAX_BOOTS) return false;
+    current_offset = stored.current_offset;
+    scale.set_offset(stored.thrust_offset);
+    return true;
+}
+
+// Store the calibration and the offsets in use
+void storage_save() {
+    StoredCalibration stored;
+    stored.version = NVS_VERSION;
+    stored.current_scale = calibration.current_scale;
+    stored.voltage_scale = calibration.voltage_scale;
+    stored.thrust_scale = calibration.thrust_scale;
+    stored.current_offset = current_offset;
+    stored.thrust_offset = scale.get_offset();
+    stored.boot = boot_count;
+
+    Preferences prefs;
+    prefs.begin(NVS_NAMESPACE, false);
+    prefs.putBytes("cal", &stored, sizeof(stored));
+    prefs.end();
+}
+
+//
+// Initialization
+//
+
+// Allocate the result pool of buffered sweeps once, from PSRAM when the board has some,
+// otherwise from what the internal heap can spare. Nothing is allocated while a sweep runs.
+void results_begin() {
+    size_t max_bytes = (MAX_MEASURE_STEPS + 1) * sizeof(Measurements);
+    size_t bytes = 0;
+    if (psramFound()) {
+        bytes = min(max_bytes, heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM));
+        // A block too small for one entry is no pool
+        measurements = bytes >= sizeof(Measurements) ? static_cast<Measurements *>(heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM)) : nullptr;
+    }
+    if (measurements == nullptr) {
+        size_t free_bytes = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+        bytes = free_bytes > RESULT_HEAP_RESERVE ? min(max_bytes, free_bytes - RESULT_HEAP_RESERVE) : 0;
+        measurements = bytes >= sizeof(Measurements) ? static_cast<Measurements *>(heap_caps_malloc(bytes, MALLOC_CAP_8BIT)) : nullptr;
+    }
+    size_t entries = measurements != nullptr ? bytes / sizeof(Measurements) : 0;
+    max_measure_steps = entries > 0 ? entries - 1 : 0;
+}
+
+// Run every idle check on one window of buffered samples, return the failing ones as INIT_FAULT_* bits
+// Each fault queues its LED pattern, played by led_task() in the background
+uint8_t init_check(const Measurements &m) {
+    uint8_t faults = 0;
+    if (m.rpm > INIT_MAX_RPM)         faults |= 1 << INIT_FAULT_RPM;
+    if (m.current > INIT_MAX_CURRENT) faults |= 1 << INIT_FAULT_CURRENT;
+    if (m.voltage < INIT_MIN_VOLTAGE) faults |= 1 << INIT_FAULT_VOLTAGE;
+    if (m.thrust > INIT_MAX_THRUST)   faults |= 1 << INIT_FAULT_THRUST;
+    if (system_paused)                faults |= 1 << INIT_FAULT_SWITCH;
+
+    for (int i = 0; i < INIT_FAULT_COUNT; i++) {
+        if (faults & (1 << i)) led_pattern(i + 1);
+    }
+    return faults;
+}
+
+// Zero the current and thrust offsets on the idle readings of the checked window, and store them
+void init_tare(const Measurements &m) {
+    current_offset -= m.current;
+    scale.set_offset(scale.get_offset() + lroundf(m.thrust * scale.get_scale()));
+    storage_save();
+}
+
+// Handle system initialization: check all the channels over one shared window, then calibrate on it
+uint8_t sys_init() {
+    unsigned long running_us = micros() - max(adc_start_us, thrust_start_us);
+    if (running_us < INIT_WINDOW_MS * 1000) {
+        delay(INIT_WINDOW_MS - running_us / 1000 + 1);
+    }
+    uint32_t now_us = micros();
+    Measurements m;
+    reduce_window(now_us - INIT_WINDOW_MS * 1000, now_us, m, true);
+
+    uint8_t faults = init_check(m);
+    if (faults == 0) init_tare(m);
+    return faults;
+}
+
+// Same checks on a short window of the samples already buffered, and only tare again
+// when the offsets have drifted. retared tells whether they were measured again.
+uint8_t quick_init(bool &retared) {
+    uint32_t now_us = micros();
+    Measurements m;
+    reduce_window(now_us - QUICK_WINDOW_MS * 1000, now_us, m, true);
+
+    uint8_t faults = init_check(m);
+    retared = faults == 0 && (fabsf(m.current) > QUICK_MAX_CURRENT_DRIFT || fabsf(m.thrust) > QUICK_MAX_THRUST_DRIFT);
+    if (retared) init_tare(m);
+    return faults;
+}
+
+//
+// Sweep
+//
+
+// Hand a record over to the host link on the other core
+void push_record(const Record &record) {
+    if (!records.push(record)) records_dropped++;
+}
+
+// Drop the runs left of the current command and every queued command, each one is told why
+void batch_cancel(const char *error) {
+    batch.runs_left = 0;
+    Command command;
+    while (commands.pop(command)) {
+        Record record;
+        record.type = RECORD_ERROR;
+        record.command = command.type;
+        record.id = command.id;
+        record.has_id = true;
+        record.ok = false;
+        record.error = error;
+        push_record(record);
+    }
+    batch_active = false;
+}
+
+// Shape of a profile at x (0 - 1) of its range. The "log" one is (B^x - 1) / (B - 1), which starts at 0 (idle),
+// so neighbouring levels do not have a constant ratio
+float profile_shape(ProfileKind kind, float x) {
+    if (kind == PROFILE_LOG) return (powf(PROFILE_LOG_BASE, x) - 1.0) / (PROFILE_LOG_BASE - 1.0);
+    return x;
+}
+
+// Levels of a stepped profile: steps + 1, 2 * steps + 1 for a staircase, or the given levels
+int profile_levels(const Command &command) {
+    if (command.profile == PROFILE_LEVELS) return command.n_levels;
+    if (command.profile == PROFILE_STAIRCASE) return 2 * command.steps + 1;
+    return command.steps + 1;
+}
+
+// Level i of a stepped profile, relative to throttle_scale
+float profile_level(const Command &command, int i) {
+    if (command.profile == PROFILE_LEVELS) return command.levels[i];
+    if (command.profile == PROFILE_STAIRCASE && i > command.steps) i = 2 * command.steps - i;
+    return profile_shape(command.profile, static_cast<float>(i) / static_cast<float>(command.steps));
+}
+
+// Throttle output of a ramp profile t_ms after its start
+float ramp_throttle_at(const Command &command, uint32_t t_ms) {
+    if (command.profile == PROFILE_POINTS) {
+        if (t_ms <= command.points[0].t_ms) return command.points[0].throttle;
+        for (int i = 1; i < command.n_points; i++) {
+            const RampPoint &a = command.points[i - 1];
+            const RampPoint &b = command.points[i];
+            if (t_ms < b.t_ms) {
+                return a.throttle + (b.throttle - a.throttle) * static_cast<float>(t_ms - a.t_ms) / static_cast<float>(b.t_ms - a.t_ms);
+            }
+        }
+        return command.points[command.n_points - 1].throttle;
+    }
+    if (command.profile == PROFILE_LINEAR || command.profile == PROFILE_LOG) {
+        float x = min(1.0f, static_cast<float>(t_ms) / static_cast<float>(command.duration_ms));
+        return profile_shape(command.profile, x) * command.throttle_scale;
+    }
+    int level = min(static_cast<int>(t_ms / command.hold_ms), profile_levels(command) - 1);
+    return profile_level(command, level) * command.throttle_scale;
+}
+
+// Length of a ramp profile
+uint32_t ramp_duration_ms(const Command &command) {
+    if (command.profile == PROFILE_POINTS) return command.points[command.n_points - 1].t_ms;
+    if (command.profile == PROFILE_LINEAR || command.profile == PROFILE_LOG) return command.duration_ms;
+    return profile_levels(command) * command.hold_ms;
+}
+
+uint16_t profile_setpoint(float throttle) {
+    return static_cast<uint16_t>(lroundf(constrain(throttle, 0.0f, 1.0f) * PROFILE_FULL_SCALE));
+}
+
+float profile_output(int i) {
+    return static_cast<float>(profile.table[i]) / PROFILE_FULL_SCALE;
+}
+
+// Compile the levels of a step sweep into the setpoint table, one entry per step
+void profile_compile_steps(const Command &command) {
+    profile.len = profile_levels(command);
+    profile.tick_us = 0;
+    for (int i = 0; i < profile.len; i++) {
+        profile.table[i] = profile_setpoint(profile_level(command, i) * command.throttle_scale);
+    }
+}
+
+// Compile a ramp profile into the setpoint table, at the finest tick that fits its whole length
+void profile_compile_ramp(const Command &command) {
+    uint64_t duration_us = static_cast<uint64_t>(ramp_duration_ms(command)) * 1000;
+    uint64_t tick_us = (duration_us + PROFILE_TABLE_SIZE - 2) / (PROFILE_TABLE_SIZE - 1);
+    profile.tick_us = max(static_cast<uint32_t>(PROFILE_MIN_TICK_US), static_cast<uint32_t>(tick_us));
+    profile.len = duration_us / profile.tick_us + 1;
+    for (int i = 0; i < profile.len; i++) {
+        uint32_t t_ms = static_cast<uint64_t>(i) * profile.tick_us / 1000;
+        profile.table[i] = profile_setpoint(ramp_throttle_at(command, t_ms));
+    }
+}
+
+// Play the setpoint table back from entry `from` on, the last entry is held for one tick before it is done
+void profile_play(int from) {
+    profile.done = false;
+    set_throttle(profile_output(from));
+    profile.index = from + 1;
+    profile.running = true;
+    timerRestart(profile_timer);
+    timerAlarmWrite(profile_timer, profile.tick_us, true);
+    timerAlarmEnable(profile_timer);
+}
+
+void profile_stop() {
+    // profile_task() outranks the loop on this core, so it sees the flag before its next write
+    profile.running = false;
+    timerAlarmDisable(profile_timer);
+}
+
+// Output the next entry of the setpoint table on every tick of the profile timer
+void profile_task(void *) {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!profile.running) continue;
+        StageTimer timer(STAGE_PROFILE_TICK);
+        int i = profile.index;
+        if (i >= profile.len) {
+            profile.running = false;
+            timerAlarmDisable(profile_timer);
+            profile.done = true;
+            continue;
+        }
+        set_throttle(profile_output(i));
+        profile.index = i + 1;
+    }
+}
+
+void profile_begin() {
+    xTaskCreatePinnedToCore(profile_task, "profile", 2048, nullptr, PROFILE_TASK_PRIORITY, &profile_task_handle, PROFILE_TASK_CORE);
+    profile_timer = timerBegin(PROFILE_TIMER_ID, 80, true);  // 1 MHz tick
+    timerAttachInterrupt(profile_timer, profile_timer_isr, true);
+}
+
+void sweep_set_state(SweepState state) {
+    sweep.state = state;
+    sweep.state_ts = millis();
+}
+
+void sweep_start_step(int step) {
+    float throttle = profile_output(step);
+    set_throttle(throttle);
+
+    sweep.step = step;
+    sweep.step_start_us = micros();
+    sweep.m = Measurements();
+    // Reported relative to throttle_scale
+    sweep.m.throttle = sweep.throttle_scale > 0.0 ? throttle / sweep.throttle_scale * 100.0 : 0.0;
+    sweep.settle = SettleWindow();
+    sweep.next_check_ms = SETTLE_CHECK_MS;
+    sweep_set_state(SWEEP_SETTLE);
+}
+
+// Start a sweep over the levels of its profile, it is then run by sweep_task()
+void sweep_begin(const Command &command) {
+    sweep.command = COMMAND_MEASURE;
+    profile_compile_steps(command);
+    sweep.steps = profile.len - 1;
+    sweep.throttle_scale = command.throttle_scale;
+    sweep.stream = command.stream;
+    sweep.settle_timeout_ms = command.settle_timeout_ms;
+    sweep.settle_rpm_tol = command.settle_rpm_tol;
+    sweep.settle_thrust_tol = command.settle_thrust_tol;
+    sweep.window_ms = command.window_ms;
+    sweep.count = 0;
+    sweep.aborted = false;
+    sweep_active = true;
+    sweep_start_step(0);
+}
+
+// Start a continuous ramp, it is then run by sweep_task()
+void ramp_begin(const Command &command) {
+    sweep.command = COMMAND_RAMP;
+    profile_compile_ramp(command);
+    // The "points" are actual outputs, their records are reported against full throttle
+    sweep.throttle_scale = command.profile == PROFILE_POINTS ? 1.0 : command.throttle_scale;
+    sweep.log_interval_us = 1000000 / command.rate_hz;
+    sweep.next_log_us = micros();
+    sweep.stream = true;
+    sweep.count = 0;
+    sweep.aborted = false;
+    sweep_active = true;
+    sweep_set_state(SWEEP_CONTINUOUS);
+    profile_play(0);
+}
+
+// Log one record of all the channels over the last logging interval of a continuous ramp
+void ramp_log(uint32_t now_us) {
+    uint32_t from_us = now_us - sweep.log_interval_us;
+    Measurements m;
+    reduce_window(from_us, now_us, m, true);
+    // Reported relative to throttle_scale, as the steps are
+    m.throttle =  sweep.throttle_scale > 0.0 ? throttle_output / sweep.throttle_scale * 100.0 : 0.0;
+    // Middle of the window, as the steps are stamped
+    m.timestamp = millis() - (micros() - now_us) / 1000 - sweep.log_interval_us / 2000;
+
+    Record record;
+    record.type = RECORD_STEP;
+    record.command = COMMAND_RAMP;
+    record.seq = sweep.count++;
+    record.m = m;
+    push_record(record);
+}
+
+// Stop the motor and send the results of the sweep
+void sweep_finish() {
+    profile_stop();
+    set_throttle(0.0);
+    sweep.state = SWEEP_IDLE;
+
+    Record record;
+    record.type = RECORD_SWEEP_DONE;
+    record.command = sweep.command;
+    record.id = batch.command.id;
+    record.run = batch.run;
+    record.has_id = true;
+    record.ok = !system_paused && !sweep.aborted;
+    if (sweep.aborted) record.error = "aborted";
+    if (system_paused) record.error = "tripped";
+    record.stream = sweep.stream;
+    record.count = sweep.count;
+    // measurements[] is read by the host link until it has serialized the buffered results
+    if (!sweep.stream) results_pending = true;
+    push_record(record);
+    sweep_active = false;
+}
+
+void sweep_next_step() {
+    if (sweep.command == COMMAND_MEASURE && !sweep.aborted && sweep.step < sweep.steps) {
+        sweep_start_step(sweep.step + 1);
+        return;
+    }
+    sweep_finish();
+    led_pattern(2);
+}
+
+// Soft ramp-down through the levels of ramp_down[] from ramp_i on, skipping the ones not below `from`
+void sweep_ramp_down(float from) {
+    static const float ramp_down[] = {0.75, 0.5, 0.25};
+
+    profile_stop();
+    while (sweep.ramp_i < 3 && ramp_down[sweep.ramp_i] >= from) {
+        sweep.ramp_i++;
+    }
+    if (sweep.ramp_i >= 3) {
+        sweep_next_step();
+        return;
+    }
+    set_throttle(ramp_down[sweep.ramp_i]);
+    sweep_set_state(SWEEP_RAMP_DOWN);
+}
+
+void sweep_step_done() {
+    if (sweep.stream) {
+        Record record;
+        record.type = RECORD_STEP;
+        record.command = COMMAND_MEASURE;
+        record.seq = sweep.step;
+        record.m = sweep.m;
+        push_record(record);
+    }
+    else {
+        measurements[sweep.step] = sweep.m;
+    }
+    sweep.count++;
+    led_pattern(1);
+
+    // Soft ramp-down from the last level
+    if (sweep.step == sweep.steps) {
+        sweep.ramp_i = 0;
+        sweep_ramp_down(throttle_output);
+        return;
+    }
+    sweep_next_step();
+}
+
+void sweep_task() {
+    if (sweep.state == SWEEP_IDLE) return;
+    if (system_paused) {
+        sweep_finish();
+        batch_cancel("tripped");
+        return;
+    }
 
-            digitalWrite(LED_GREEN_PIN, LOW);
-            is_gled_on = false;
-            /* Pattern start */
-            delay(100);
-            digitalWrite(LED_YELLOW_PIN, HIGH);
-            delay(250);
-            digitalWrite(LED_YELLOW_PIN, LOW);
-            delay(100);
-            digitalWrite(LED_YELLOW_PIN, HIGH);
-            delay(250);
-            digitalWrite(LED_YELLOW_PIN, LOW);
-            delay(100);
-            /* Pattern end */
-            digitalWrite(LED_GREEN_PIN, HIGH);
-            is_gled_on = true;
-        }
-    }
-
-    if (millis() - standby_ts > 1000) {
-        digitalWrite(LED_GREEN_PIN, is_gled_on ? LOW : HIGH);
-        is_gled_on = !is_gled_on;
-        standby_ts = millis();
-    }
-}
\ No newline at end of file
+    unsigned long elapsed_ms = millis() - sweep.state_ts;
+    switch (sweep.state) {
+        case SWEEP_SETTLE:
+            if (elapsed_ms >= sweep.next_check_ms) {
+                sweep.next_check_ms += SETTLE_CHECK_MS;
+                uint32_t now_us = micros();
+                uint32_t from_us = now_us - SETTLE_CHECK_MS * 1000;
+                settle_push(sweep.settle, rpm_window(from_us, now_us), thrust_kg(from_us, now_us));
+
+                bool settled = elapsed_ms >= SETTLE_MIN_MS && settle_done(sweep.settle, sweep.settle_rpm_tol, sweep.settle_thrust_tol);
+                if (settled || elapsed_ms >= sweep.settle_timeout_ms) {
+                    sweep.m.settle_ms = elapsed_ms;
+                    stage_stats[STAGE_SETTLE].add(elapsed_ms * 1000);
+                    acquire_begin(sweep.window_ms);
+                    sweep_set_state(SWEEP_ACQUIRE);
+                }
+            }
+            break;
+        case SWEEP_ACQUIRE:
+            if (acquire_poll(sweep.m)) {
+                stage_stats[STAGE_ACQUIRE].add(elapsed_ms * 1000);
+                stage_stats[STAGE_STEP].add(micros() - sweep.step_start_us);
+                sweep_step_done();
+            }
+            break;
+        case SWEEP_CONTINUOUS: {
+            uint32_t now_us = micros();
+            if (static_cast<int32_t>(now_us - sweep.next_log_us) >= 0) {
+                sweep.next_log_us += sweep.log_interval_us;
+                ramp_log(now_us);
+            }
+            if (profile.done) {
+                sweep.ramp_i = 0;
+                sweep_ramp_down(throttle_output);
+            }
+            break;
+        }
+        case SWEEP_RAMP_DOWN:
+            if (elapsed_ms >= RAMP_DOWN_STEP_MS) {
+                sweep.ramp_i++;
+                sweep_ramp_down(1.0);
+            }
+            break;
+        case SWEEP_PAUSED:
+        case SWEEP_IDLE:
+            break;
+    }
+}
+
+//
+// Commands
+//
+
+// Run one command, sweeps then go on in the background
+void handle_command(const Command &command) {
+    Record started;
+    started.type = RECORD_STARTED;
+    started.command = command.type;
+    started.id = command.id;
+    started.run = batch.run;
+    push_record(started);
+
+    if (command.type == COMMAND_SYS_INIT || command.type == COMMAND_QUICK_INIT) {
+        Record record;
+        record.type = RECORD_SYS_INIT;
+        record.command = command.type;
+        record.id = command.id;
+        record.run = batch.run;
+        record.has_id = true;
+        StageTimer timer(STAGE_INIT);
+        if (command.type == COMMAND_SYS_INIT) {
+            record.faults = sys_init();
+        }
+        else {
+            record.faults = quick_init(record.retared);
+        }
+        record.ok = record.faults == 0;
+        push_record(record);
+
+        led_pattern(2);
+    }
+    else if (system_paused) {
+        Record record;
+        record.type = RECORD_ERROR;
+        record.command = command.type;
+        record.id = command.id;
+        record.run = batch.run;
+        record.has_id = true;
+        record.ok = false;
+        record.error = "tripped";
+        push_record(record);
+    }
+    else if (command.type == COMMAND_MEASURE) {
+        sweep_begin(command);
+    }
+    else if (command.type == COMMAND_RAMP) {
+        ramp_begin(command);
+    }
+}
+
+// Handle one control right away, return the reason it was refused or nullptr
+const char *handle_control(const Command &control) {
+    bool running = sweep.state == SWEEP_SETTLE || sweep.state == SWEEP_ACQUIRE || sweep.state == SWEEP_CONTINUOUS;
+
+    if (control.type == COMMAND_ABORT) {
+        // Ramp down softly from the current throttle, then send what was measured so far
+        batch_cancel("aborted");
+        if (sweep.state == SWEEP_IDLE) return nullptr;
+        sweep.aborted = true;
+        if (sweep.state != SWEEP_RAMP_DOWN) {
+            sweep.ramp_i = 0;
+            sweep_ramp_down(throttle_output);
+        }
+        return nullptr;
+    }
+    if (control.type == COMMAND_PAUSE) {
+        if (!running) return "not_running";
+        sweep.paused_state = sweep.state;
+        profile_stop();
+        sweep_set_state(SWEEP_PAUSED);
+        set_throttle(0.0);
+        return nullptr;
+    }
+    if (control.type == COMMAND_RESUME) {
+        if (sweep.state != SWEEP_PAUSED) return "not_paused";
+        if (system_paused) return "tripped";
+        if (sweep.paused_state == SWEEP_CONTINUOUS) {
+            // Go on along the profile from the entry it was paused at
+            sweep_set_state(SWEEP_CONTINUOUS);
+            sweep.next_log_us = micros();
+            profile_play(max(profile.index - 1, 0));
+        }
+        else {
+            // Settle and sample the interrupted step again
+            sweep_start_step(sweep.step);
+        }
+        return nullptr;
+    }
+    if (control.type == COMMAND_SET_THROTTLE) {
+        // Manual throttle, only while no sweep drives it
+        if (sweep.state != SWEEP_IDLE && sweep.state != SWEEP_PAUSED) return "busy";
+        if (system_paused) return "tripped";
+        set_throttle(control.throttle_scale);
+        return nullptr;
+    }
+    if (control.type == COMMAND_CLEAR_TRIP) {
+        if (!system_paused) return nullptr;
+        if (sweep.state != SWEEP_IDLE || trip_pending) return "busy";
+        // Check and clear in one go: a press in between would find the trip still set, and safety_trip()
+        // would drop it. Its notification now waits for the scheduler, and runs on the cleared trip
+        uint32_t pressed_us = switch_trip_us;
+        vTaskSuspendAll();
+        if (digitalRead(SAFETY_SWITCH_PIN) == LOW) {
+            xTaskResumeAll();
+            return "switch";
+        }
+        float value = 0.0;
+        TripReason reason = safety_check(value);
+        if (reason == TRIP_NONE) {
+            trip = Trip();
+            system_paused = false;
+        }
+        xTaskResumeAll();
+        if (reason != TRIP_NONE) return trip_names[reason];
+        // Still pressed, or pressed again: trip right away rather than on the notification alone
+        if (switch_trip_us != pressed_us || digitalRead(SAFETY_SWITCH_PIN) == LOW) {
+            safety_trip(TRIP_SWITCH, switch_trip_us, 0.0);
+            return "switch";
+        }
+        led_state = LED_STANDBY;
+        digitalWrite(LED_YELLOW_PIN, LOW);
+        return nullptr;
+    }
+    return nullptr;
+}
+
+// Handle the controls from the host link, and show a safety trip on the LEDs
+void control_task() {
+    if (system_paused && led_state != LED_FAULT) led_fault();
+
+    Command control;
+    if (controls.pop(control)) {
+        Record record;
+        record.type = RECORD_CONTROL;
+        record.command = control.type;
+        record.error = handle_control(control);
+        record.ok = record.error == nullptr;
+        push_record(record);
+    }
+}
+
+// Execute the commands queued by the host link one after the other, each one repeat times.
+// The next run only starts once the sweep before it is done and its buffered results are sent.
+void command_task() {
+    if (sweep.state != SWEEP_IDLE || results_pending) return;
+    if (batch.runs_left == 0) {
+        if (commands.size() == 0) return;
+        batch_active = true;
+        commands.pop(batch.command);
+        batch.run = 0;
+        batch.runs_left = batch.command.repeat;
+    }
+    else {
+        batch.run++;
+    }
+
+    batch.runs_left--;
+    handle_command(batch.command);
+    if (batch.runs_left == 0) batch_active = false;
+}
+
+//
+// Host link
+//
+
+// Send the buffered results of a sweep, of any length. In json mode the "data" array is written one step
+// at a time, in binary mode the steps go out as FRAME_STEP records followed by a summary.
+void send_results(const Record &record) {
+    if (protocol == PROTOCOL_BINARY) {
+        for (int i = 0; i < record.count; i++) {
+            send_step(COMMAND_MEASURE, i, measurements[i]);
+        }
+        StaticJsonDocument<128> return_doc;
+        return_doc["response_type"] = "measure";
+        return_doc["ok"] = record.ok;
+        if (record.error) return_doc["error"] = record.error;
+        return_doc["id"] = record.id;
+        return_doc["run"] = record.run;
+        return_doc["count"] = record.count;
+        send_json(return_doc);
+        return;
+    }
+
+    // Each piece is serialized into the frame buffer, then written, timed as send_json() is
+    char *line = reinterpret_cast<char *>(frame_raw);
+    size_t len;
+    {
+        StageTimer timer(STAGE_SERIALIZE);
+        len = snprintf(line, sizeof(frame_raw), "{\"response_type\":\"measure\",\"ok\":%s,", record.ok ? "true" : "false");
+        if (record.error) len += snprintf(line + len, sizeof(frame_raw) - len, "\"error\":\"%s\",", record.error);
+        len += snprintf(line + len, sizeof(frame_raw) - len, "\"id\":%u,\"run\":%d,\"data\":[",
+                        static_cast<unsigned>(record.id), record.run);
+    }
+    {
+        StageTimer timer(STAGE_SERIAL_WRITE);
+        Serial.write(frame_raw, len);
+    }
+    for (int i = 0; i < record.count; i++) {
+        {
+            StageTimer timer(STAGE_SERIALIZE);
+            StaticJsonDocument<256> step_doc;
+            write_measurements(step_doc.to<JsonObject>(), measurements[i]);
+            len = 0;
+            if (i > 0) line[len++] = ',';
+            len += serializeJson(step_doc, line + len, sizeof(frame_raw) - len);
+        }
+        StageTimer timer(STAGE_SERIAL_WRITE);
+        Serial.write(frame_raw, len);
+    }
+    StageTimer timer(STAGE_SERIAL_WRITE);
+    Serial.print("]}\n");
+}
+
+// Serialize one record coming from the acquisition side
+void send_record(const Record &record) {
+    if (record.type == RECORD_STEP) {
+        send_step(record.command, record.seq, record.m);
+        return;
+    }
+    if (record.type == RECORD_SWEEP_DONE && !record.stream) {
+        send_results(record);
+        results_pending = false;
+        return;
+    }
+
+    StaticJsonDocument<256> return_doc;
+    if (record.type == RECORD_STARTED) {
+        return_doc["response_type"] = "started";
+        return_doc["command"] = command_names[record.command];
+        return_doc["id"] = record.id;
+        return_doc["run"] = record.run;
+        send_json(return_doc);
+        return;
+    }
+
+    return_doc["response_type"] = command_names[record.command];
+    return_doc["ok"] = record.ok;
+    if (record.has_id) {
+        return_doc["id"] = record.id;
+        return_doc["run"] = record.run;
+    }
+    if (record.type == RECORD_SWEEP_DONE) {
+        if (record.error) return_doc["error"] = record.error;
+        return_doc["stream"] = true;
+        return_doc["count"] = record.count;
+        return_doc["dropped"] = records_dropped.exchange(0);
+    }
+    else if (record.type == RECORD_CONTROL) {
+        if (record.error) return_doc["error"] = record.error;
+    }
+    else if (record.type == RECORD_ERROR) {
+        return_doc["error"] = record.error;
+        if (strcmp(record.error, "too_many_steps") == 0) return_doc["max_steps"] = max_measure_steps;
+    }
+    else if (record.type == RECORD_SYS_INIT) {
+        if (record.command == COMMAND_QUICK_INIT) return_doc["retared"] = record.retared;
+        JsonArray faults = return_doc.createNestedArray("faults");
+        for (int i = 0; i < INIT_FAULT_COUNT; i++) {
+            if (record.faults & (1 << i)) faults.add(init_fault_names[i]);
+        }
+        return_doc["controller_id"] = controller_id;
+    }
+    send_json(return_doc);
+}
+
+// Report the first safety trip with its samples
+void send_trip() {
+    StaticJsonDocument<3072> trip_doc;
+    trip_doc["response_type"] = "trip";
+    trip_doc["reason"] = trip_names[trip.reason];
+    trip_doc["ts_us"] = trip.ts_us;
+    trip_doc["value"] = trip.value;
+    JsonArray adc_array = trip_doc.createNestedArray("adc");
+    for (int i = 0; i < trip.n_adc; i++) {
+        JsonArray sample = adc_array.createNestedArray();
+        sample.add(trip.adc[i].ts_us);
+        sample.add(adc_to_current(current_lut[trip.adc[i].current_raw]) + current_offset);
+        sample.add(adc_to_voltage(voltage_lut[trip.adc[i].voltage_raw]));
+    }
+    JsonArray thrust_array = trip_doc.createNestedArray("thrust");
+    for (int i = 0; i < trip.n_thrust; i++) {
+        JsonArray sample = thrust_array.createNestedArray();
+        sample.add(trip.thrust[i].ts_us);
+        sample.add(thrust_to_kg(trip.thrust[i].raw));
+    }
+    send_json(trip_doc);
+}
+
+// Copy the samples of one capture channel from next on into a frame payload, return the bytes used
+template <typename T>
+size_t dump_copy(const ArenaRing<T> &ring, uint32_t &next, uint32_t end, uint8_t *out, size_t size) {
+    size_t n = min(static_cast<size_t>(end - next), size / sizeof(T));
+    for (size_t i = 0; i < n; i++) {
+        memcpy(out + i * sizeof(T), &ring.at(next + i), sizeof(T));
+    }
+    next += n;
+    return n * sizeof(T);
+}
+
+// Take the range of every capture channel to send
+void dump_start() {
+    uint32_t heads[3] = {capture.adc.head, capture.thrust.head, capture.rpm.head};
+    dump.next[0] = capture.adc.first(heads[0]);
+    dump.next[1] = capture.thrust.first(heads[1]);
+    dump.next[2] = capture.rpm.first(heads[2]);
+    for (int i = 0; i < 3; i++) {
+        dump.end[i] = heads[i];
+        dump.count[i] = heads[i] - dump.next[i];
+    }
+    dump.channel = 0;
+    dump.seq = 0;
+    dump.active = true;
+}
+
+// Summary closing a dump, with what the host needs to convert the raw samples
+void send_dump_summary() {
+    StaticJsonDocument<384> return_doc;
+    return_doc["response_type"] = "dump";
+    return_doc["ok"] = true;
+    return_doc["trigger"] = capture.trigger;
+    return_doc["trigger_us"] = capture.trigger_us;
+    return_doc["end_us"] = capture.end_us;
+    return_doc["frames"] = dump.seq;
+    return_doc["adc"] = dump.count[0];
+    return_doc["thrust"] = dump.count[1];
+    return_doc["rpm"] = dump.count[2];
+    return_doc["current_scale"] = calibration.current_scale;
+    return_doc["current_offset"] = current_offset;
+    return_doc["voltage_scale"] = calibration.voltage_scale;
+    return_doc["thrust_scale"] = scale.get_scale();
+    return_doc["thrust_offset"] = scale.get_offset();
+    send_json(return_doc);
+}
+
+// Send the next frame of a capture dump, then the summary, and arm the capture again
+void dump_poll() {
+    if (dump.pending) {
+        if (!capture_done(micros())) return;
+        dump.pending = false;
+        dump_start();
+    }
+    if (!dump.active) return;
+
+    while (dump.channel < 3 && dump.next[dump.channel] == dump.end[dump.channel]) dump.channel++;
+    uint8_t *payload = frame_raw + 1;
+    size_t size = FRAME_MAX_PAYLOAD - sizeof(dump.seq);
+    size_t len = sizeof(dump.seq);
+    memcpy(payload, &dump.seq, sizeof(dump.seq));
+    switch (dump.channel) {
+        case 0:
+            len += dump_copy(capture.adc, dump.next[0], dump.end[0], payload + len, size);
+            send_frame(FRAME_CAPTURE_ADC, len);
+            break;
+        case 1:
+            len += dump_copy(capture.thrust, dump.next[1], dump.end[1], payload + len, size);
+            send_frame(FRAME_CAPTURE_THRUST, len);
+            break;
+        case 2:
+            len += dump_copy(capture.rpm, dump.next[2], dump.end[2], payload + len, size);
+            send_frame(FRAME_CAPTURE_RPM, len);
+            break;
+        default:
+            send_dump_summary();
+            dump.active = false;
+            capture_arm();
+            return;
+    }
+    dump.seq++;
+}
+
+// Whether the acquisition side is running or has commands waiting, settings only change in between
+bool acquisition_busy() {
+    return commands.size() > 0 || batch_active || sweep_active;
+}
+
+// Reply to a command that could not be accepted
+void send_error(CommandType command, const char *error) {
+    Record record;
+    record.type = RECORD_ERROR;
+    record.command = command;
+    record.ok = false;
+    record.error = error;
+    send_record(record);
+}
+
+// Reply to input that could not be taken as a command at all
+void send_command_error(const char *error) {
+    StaticJsonDocument<96> return_doc;
+    return_doc["response_type"] = "error";
+    return_doc["ok"] = false;
+    return_doc["error"] = error;
+    send_json(return_doc);
+}
+
+// Fill in the profile shape of a measure or ramp command, return false if it is not valid
+bool parse_profile(JsonObject command_obj, Command &command) {
+    bool has_points = !command_obj["points"].isNull();
+    const char *name = command_obj["profile"] | (command.type == COMMAND_RAMP && has_points ? "points" : "linear");
+    int kind = 0;
+    while (kind < PROFILE_COUNT && strcmp(name, profile_names[kind]) != 0) kind++;
+    if (kind == PROFILE_COUNT) return false;
+    command.profile = static_cast<ProfileKind>(kind);
+    if (command.profile == PROFILE_POINTS) return command.type == COMMAND_RAMP;
+
+    command.steps = command_obj["steps"] | 0;
+    command.hold_ms = command_obj["hold_ms"] | static_cast<uint32_t>(PROFILE_HOLD_MS);
+    command.duration_ms = command_obj["duration_ms"] | static_cast<uint32_t>(RAMP_DURATION_MS);
+    if (command.hold_ms == 0 || command.duration_ms == 0) return false;
+
+    if (command.profile == PROFILE_LEVELS) {
+        JsonArray levels = command_obj["levels"];
+        if (levels.size() < 1 || levels.size() > PROFILE_MAX_LEVELS) return false;
+        command.n_levels = 0;
+        for (JsonVariant level : levels) {
+            float value = level.as<float>();
+            if (value < 0.0 || value > 1.0) return false;
+            command.levels[command.n_levels++] = value;
+        }
+        return true;
+    }
+    // A continuous ramp needs no steps
+    bool stepped = command.type == COMMAND_MEASURE || command.profile == PROFILE_STEPS || command.profile == PROFILE_STAIRCASE;
+    if (stepped && command.steps < 1) return false;
+    return profile_levels(command) <= PROFILE_TABLE_SIZE;
+}
+
+// Fill in the ramp profile of a command, return false if it is not valid
+bool parse_ramp(JsonObject command_obj, Command &command) {
+    command.rate_hz = command_obj["rate_hz"] | RAMP_RATE_HZ;
+    if (command.rate_hz <= 0 || command.rate_hz > RAMP_MAX_RATE_HZ) return false;
+    if (command.throttle_scale < 0.0 || command.throttle_scale > 1.0) return false;
+    if (!parse_profile(command_obj, command)) return false;
+    if (command.profile != PROFILE_POINTS) return true;
+
+    JsonArray points = command_obj["points"];
+    if (points.size() < 1 || points.size() > RAMP_MAX_POINTS) return false;
+    command.n_points = 0;
+    for (JsonVariant point : points) {
+        RampPoint p = {point[0].as<uint32_t>(), point[1].as<float>()};
+        bool in_order = command.n_points == 0 || p.t_ms > command.points[command.n_points - 1].t_ms;
+        if (!in_order || p.throttle < 0.0 || p.throttle > 1.0) return false;
+        command.points[command.n_points++] = p;
+    }
+    return true;
+}
+
+// Switch the protocol and baud of the host link, handled right here since it only concerns this side
+void handle_set_protocol(JsonObject command_obj) {
+    StaticJsonDocument<128> return_doc;
+    const char *protocol_name = command_obj["protocol"] | "json";
+    unsigned long baud = command_obj["baud"] | 0UL;
+    bool is_binary = strcmp(protocol_name, "binary") == 0;
+    bool ok = (is_binary || strcmp(protocol_name, "json") == 0) && baud <= SERIAL_MAX_BAUD;
+
+    return_doc["response_type"] = "set_protocol";
+    return_doc["ok"] = ok;
+    return_doc["protocol"] = protocol_name;
+    if (baud > 0) return_doc["baud"] = baud;
+    // No protocol changes in the middle of a sweep or a dump
+    if (acquisition_busy() || dump.pending || dump.active) {
+        return_doc["ok"] = false;
+        return_doc["error"] = "busy";
+        send_json(return_doc);
+        return;
+    }
+    send_json(return_doc);
+    Serial.flush();
+
+    if (ok) {
+        protocol = is_binary ? PROTOCOL_BINARY : PROTOCOL_JSON;
+        if (baud > 0) Serial.updateBaudRate(baud);
+    }
+}
+
+// Change the filter stage of one channel, handed straight to the task sampling it
+void handle_set_filter(JsonObject command_obj) {
+    StaticJsonDocument<128> return_doc;
+    const char *channel = command_obj["channel"] | "";
+    ChannelFilter *filter = nullptr;
+    if (strcmp(channel, "current") == 0) filter = &current_filter;
+    if (strcmp(channel, "thrust") == 0) filter = &thrust_filter;
+
+    FilterConfig config;
+    config.lowpass_hz = command_obj["lowpass_hz"] | 0.0;
+    config.notch = command_obj["notch"] | false;
+    config.notch_q = command_obj["notch_q"] | FILTER_NOTCH_Q;
+    config.blades = command_obj["blades"] | FILTER_BLADES;
+    bool ok = filter != nullptr && config.notch_q > 0.0 && config.blades >= 1 && config.blades <= FILTER_MAX_BLADES;
+    if (ok && config.lowpass_hz != 0.0) {
+        ok = config.lowpass_hz >= FILTER_MIN_HZ && config.lowpass_hz <= FILTER_MAX_REL_HZ * filter->fs;
+    }
+
+    return_doc["response_type"] = "set_filter";
+    return_doc["ok"] = ok;
+    return_doc["channel"] = channel;
+    if (!ok) {
+        return_doc["error"] = "invalid";
+    }
+    // No filter changes in the middle of a sweep
+    else if (acquisition_busy()) {
+        return_doc["ok"] = false;
+        return_doc["error"] = "busy";
+    }
+    else {
+        filter_configure(*filter, config);
+    }
+    send_json(return_doc);
+}
+
+// Load new conversion coefficients, the omitted ones are kept. Replies with the coefficients in use.
+void handle_set_calibration(JsonObject command_obj) {
+    StaticJsonDocument<256> return_doc;
+    Calibration updated = calibration;
+    updated.current_scale = command_obj["current_scale"] | calibration.current_scale;
+    updated.voltage_scale = command_obj["voltage_scale"] | calibration.voltage_scale;
+    updated.thrust_scale = command_obj["thrust_scale"] | calibration.thrust_scale;
+    bool ok = updated.current_scale > 0.0 && updated.voltage_scale > 0.0 && updated.thrust_scale != 0.0;
+
+    return_doc["response_type"] = "set_calibration";
+    return_doc["ok"] = ok;
+    if (!ok) {
+        return_doc["error"] = "invalid";
+    }
+    // No calibration changes in the middle of a sweep
+    else if (acquisition_busy()) {
+        return_doc["ok"] = false;
+        return_doc["error"] = "busy";
+    }
+    else {
+        calibration = updated;
+        scale.set_scale(calibration.thrust_scale);
+        storage_save();
+    }
+    return_doc["current_scale"] = calibration.current_scale;
+    return_doc["voltage_scale"] = calibration.voltage_scale;
+    return_doc["thrust_scale"] = calibration.thrust_scale;
+    return_doc["current_adc_cal"] = adc_cal_names[calibration.current_cal];
+    return_doc["voltage_adc_cal"] = adc_cal_names[calibration.voltage_cal];
+    send_json(return_doc);
+}
+
+// Fill in a control (abort, pause, resume, set_throttle, clear_trip), return false for any other command
+bool parse_control(JsonObject command_obj, Command &command) {
+    for (int type = COMMAND_ABORT; type <= COMMAND_CLEAR_TRIP; type++) {
+        if (command_obj["command_type"] == command_names[type]) {
+            command.type = static_cast<CommandType>(type);
+            command.throttle_scale = command_obj["throttle"] | 0.0;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Send the capture as binary frames, triggering it right now unless an event already did
+void handle_dump(JsonObject command_obj) {
+    const char *error = nullptr;
+    if (protocol != PROTOCOL_BINARY) error = "binary_only";
+    if (dump.pending || dump.active) error = "busy";
+    if (error != nullptr) {
+        StaticJsonDocument<96> return_doc;
+        return_doc["response_type"] = "dump";
+        return_doc["ok"] = false;
+        return_doc["error"] = error;
+        send_json(return_doc);
+        return;
+    }
+    uint32_t now_us = micros();
+    capture_trigger("dump", now_us, now_us);
+    dump.pending = true;
+}
+
+// Set the events that trigger the capture, "arm": true drops a held capture. An empty command only reads
+// the settings back.
+void handle_set_capture(JsonObject command_obj) {
+    StaticJsonDocument<384> return_doc;
+    float spike_a = command_obj["spike_a"] | capture.spike_a;
+    uint32_t post_ms = command_obj["post_ms"] | capture.post_ms;
+    bool on_trip = command_obj["on_trip"] | capture.on_trip;
+    bool ok = spike_a >= 0.0 && post_ms <= CAPTURE_MAX_POST_MS;
+
+    return_doc["response_type"] = "set_capture";
+    return_doc["ok"] = ok;
+    if (!ok) {
+        return_doc["error"] = "invalid";
+    }
+    // The held capture is kept until it has been sent
+    else if (dump.pending || dump.active) {
+        return_doc["ok"] = false;
+        return_doc["error"] = "busy";
+    }
+    else {
+        capture.spike_a = spike_a;
+        capture.post_ms = post_ms;
+        capture.on_trip = on_trip;
+        if (command_obj["arm"] | false) capture_arm();
+        capture.watching = false;
+    }
+    return_doc["spike_a"] = capture.spike_a;
+    return_doc["post_ms"] = capture.post_ms;
+    return_doc["on_trip"] = capture.on_trip;
+    return_doc["triggered"] = capture.triggered.load();
+    return_doc["trigger"] = capture.trigger;
+    JsonObject sizes = return_doc.createNestedObject("capacity");
+    sizes["adc"] = capture.adc.mask;
+    sizes["thrust"] = capture.thrust.mask;
+    sizes["rpm"] = capture.rpm.mask;
+    send_json(return_doc);
+}
+
+// Answer the heartbeat of the host
+void handle_ping() {
+    StaticJsonDocument<160> return_doc;
+    return_doc["response_type"] = "ping";
+    return_doc["ok"] = true;
+    return_doc["uptime_ms"] = millis();
+    return_doc["queued"] = commands.size();
+    return_doc["controller_id"] = controller_id;
+    return_doc["firmware"] = FIRMWARE_BUILD;
+    send_json(return_doc);
+}
+
+// Report the run time of every stage and the interrupt rates since boot or the last reset, "reset": true
+// starts over once they are sent
+void handle_stats(JsonObject command_obj) {
+    static StaticJsonDocument<2560> return_doc;
+    return_doc.clear();
+    uint32_t now_us = micros();
+    float since_s = (now_us - stats_since_us) / 1000000.0;
+    return_doc["response_type"] = "stats";
+    return_doc["ok"] = true;
+    return_doc["uptime_ms"] = millis();
+    return_doc["since_ms"] = (now_us - stats_since_us) / 1000;
+
+    JsonObject stages = return_doc.createNestedObject("stages");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const StageStats &stats = stage_stats[i];
+        bool empty = stats.n == 0 || stats.reset;
+        JsonObject stage = stages.createNestedObject(stage_names[i]);
+        stage["n"] = empty ? 0 : stats.n;
+        stage["mean_us"] = empty ? 0.0 : static_cast<float>(stats.total_us) / stats.n;
+        stage["min_us"] = empty ? 0 : stats.min_us;
+        stage["max_us"] = empty ? 0 : stats.max_us;
+    }
+    JsonObject isrs = return_doc.createNestedObject("isr");
+    for (int i = 0; i < ISR_COUNT; i++) {
+        uint32_t hits = isr_hits[i] - isr_hits_base[i];
+        JsonObject isr = isrs.createNestedObject(isr_names[i]);
+        isr["n"] = hits;
+        isr["hz"] = since_s > 0.0 ? hits / since_s : 0.0;
+    }
+    return_doc["records_dropped"] = records_dropped.load();
+    return_doc["free_heap"] = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    send_json(return_doc);
+
+    if (command_obj["reset"] | false) {
+        for (int i = 0; i < STAGE_COUNT; i++) stage_stats[i].reset = true;
+        for (int i = 0; i < ISR_COUNT; i++) isr_hits_base[i] = isr_hits[i];
+        stats_since_us = now_us;
+    }
+}
+
+// Parse one command from the host into the command queue, or the control queue
+void parse_command(JsonObject command_obj) {
+    if (!command_obj["command_type"].is<const char *>()) {
+        send_command_error("invalid");
+        return;
+    }
+
+    if (command_obj["command_type"] == "set_protocol") {
+        handle_set_protocol(command_obj);
+        return;
+    }
+    if (command_obj["command_type"] == "set_filter") {
+        handle_set_filter(command_obj);
+        return;
+    }
+    if (command_obj["command_type"] == "set_calibration") {
+        handle_set_calibration(command_obj);
+        return;
+    }
+    if (command_obj["command_type"] == "set_capture") {
+        handle_set_capture(command_obj);
+        return;
+    }
+    if (command_obj["command_type"] == "dump") {
+        handle_dump(command_obj);
+        return;
+    }
+    if (command_obj["command_type"] == "stats") {
+        handle_stats(command_obj);
+        return;
+    }
+    if (command_obj["command_type"] == "ping") {
+        handle_ping();
+        return;
+    }
+
+    Command command;
+    if (command_obj["command_type"] == "sys_init") {
+        command.type = COMMAND_SYS_INIT;
+    }
+    else if (command_obj["command_type"] == "quick_init") {
+        command.type = COMMAND_QUICK_INIT;
+    }
+    else if (parse_control(command_obj, command)) {
+        if (command.type == COMMAND_SET_THROTTLE && (command.throttle_scale < 0.0 || command.throttle_scale > 1.0)) {
+            send_error(command.type, "invalid");
+        }
+        else if (!controls.push(command)) {
+            send_error(command.type, "busy");
+        }
+        return;
+    }
+    else if (command_obj["command_type"] == "measure") {
+        command.type = COMMAND_MEASURE;
+        command.throttle_scale = command_obj["throttle_scale"] | 1.0;
+        command.stream = command_obj["stream"] | false;
+        if (!parse_profile(command_obj, command) || command.throttle_scale < 0.0 || command.throttle_scale > 1.0) {
+            send_error(command.type, "invalid");
+            return;
+        }
+        // Streamed steps are not kept, so only buffered sweeps are limited by the result pool, or refused without one
+        if (!command.stream && (measurements == nullptr || profile_levels(command) - 1 > max_measure_steps)) {
+            send_error(command.type, "too_many_steps");
+            return;
+        }
+        command.settle_timeout_ms = command_obj["settle_timeout_ms"] | static_cast<unsigned long>(SETTLE_TIMEOUT_MS);
+        command.settle_rpm_tol = command_obj["settle_rpm_tol"] | SETTLE_RPM_TOL;
+        command.settle_thrust_tol = command_obj["settle_thrust_tol"] | SETTLE_THRUST_TOL;
+        command.window_ms = command_obj["window_ms"] | static_cast<unsigned long>(ACQUIRE_WINDOW_MS);
+        if (command.window_ms < ACQUIRE_MIN_WINDOW_MS || command.window_ms > ACQUIRE_MAX_WINDOW_MS) {
+            send_error(command.type, "invalid");
+            return;
+        }
+    }
+    else if (command_obj["command_type"] == "ramp") {
+        command.type = COMMAND_RAMP;
+        command.throttle_scale = command_obj["throttle_scale"] | 1.0;
+        command.stream = true;
+        if (!parse_ramp(command_obj, command)) {
+            send_error(command.type, "invalid");
+            return;
+        }
+    }
+    else {
+        send_command_error("unknown_command");
+        return;
+    }
+
+    command.id = command_obj["id"] | next_command_id;
+    command.repeat = command_obj["repeat"] | 1;
+    if (command.repeat < 1 || command.repeat > COMMAND_MAX_REPEAT) {
+        send_error(command.type, "invalid");
+        return;
+    }
+    if (!commands.push(command)) {
+        send_error(command.type, "busy");
+        return;
+    }
+    next_command_id = command.id + 1;
+
+    StaticJsonDocument<128> return_doc;
+    return_doc["response_type"] = "queued";
+    return_doc["command"] = command_names[command.type];
+    return_doc["id"] = command.id;
+    return_doc["repeat"] = command.repeat;
+    return_doc["queued"] = commands.size();
+    send_json(return_doc);
+}
+
+// Feed one received byte to the command reader, return true when a command is complete
+bool command_reader_push(char c) {
+    CommandReader &reader = command_reader;
+    if (c == '\n' || c == '\r') return reader.len > 0 || reader.overflow;
+    if (reader.len == 0 && c != '{' && !reader.overflow) return false;  // Skip whatever precedes a command
+
+    if (reader.len < COMMAND_LINE_SIZE) {
+        reader.line[reader.len++] = c;
+    }
+    else {
+        reader.overflow = true;
+    }
+
+    if (reader.escape) {
+        reader.escape = false;
+    }
+    else if (reader.in_string) {
+        if (c == '\\') reader.escape = true;
+        else if (c == '"') reader.in_string = false;
+    }
+    else if (c == '"') {
+        reader.in_string = true;
+    }
+    else if (c == '{') {
+        reader.depth++;
+    }
+    else if (c == '}') {
+        reader.depth--;
+        return reader.depth == 0;
+    }
+    return false;
+}
+
+// Parse the completed command in place and hand it on, then start collecting the next one
+void command_reader_parse() {
+    StageTimer timer(STAGE_PARSE);
+    static StaticJsonDocument<COMMAND_DOC_SIZE> command_doc;
+    CommandReader &reader = command_reader;
+    if (reader.overflow) {
+        send_command_error("too_long");
+    }
+    else if (reader.len > 0) {
+        reader.line[reader.len] = '\0';
+        // A char * input is parsed in place, the strings of command_doc point into reader.line
+        DeserializationError error = deserializeJson(command_doc, reader.line, reader.len);
+        if (error) {
+            send_command_error(error == DeserializationError::NoMemory ? "too_long" : "parse");
+        }
+        else if (!command_doc.is<JsonObject>()) {
+            send_command_error("invalid");
+        }
+        else {
+            parse_command(command_doc.as<JsonObject>());
+        }
+    }
+    reader = CommandReader();
+}
+
+// Serve the host on core 0: forward commands, and serialize whatever the acquisition side produced
+void comm_task(void *param) {
+    while (true) {
+        Record record;
+        while (records.pop(record)) {
+            send_record(record);
+        }
+        if (trip_pending.exchange(false)) {
+            send_trip();
+        }
+        dump_poll();
+
+        while (Serial.available() > 0) {
+            if (command_reader_push(Serial.read())) command_reader_parse();
+        }
+
+        vTaskDelay(1);
+    }
+}
+
+//
+// Scheduler
+//
+
+Task tasks[] = {
+    {"control", CONTROL_TASK_US, control_task, 0, STAGE_CONTROL_TASK},
+    {"command", COMMAND_TASK_US, command_task, 0, STAGE_COMMAND_TASK},
+    {"sweep",   SWEEP_TASK_US,   sweep_task,   0, STAGE_SWEEP_TASK},
+    {"led",     LED_TASK_US,     led_task,     0, STAGE_LED_TASK},
+};
+
+// Run every task that is due, none of them may block
+void scheduler_run() {
+    unsigned long now_us = micros();
+    for (Task &task : tasks) {
+        if (task.interval_us == 0 || now_us - task.last_us >= task.interval_us) {
+            task.last_us = now_us;
+            StageTimer timer(task.stage);
+            task.run();
+        }
+    }
+}
+
+//
+// Setup
+//
+
+void setup() {
+    Serial.begin(SERIAL_BAUD);
+
+    // Controller ID, the MAC bytes in their transmission order
+    uint64_t mac = ESP.getEfuseMac();
+    for (int i = 0; i < 6; i++) {
+        snprintf(controller_id + 2 * i, 3, "%02X", static_cast<unsigned>((mac >> (8 * i)) & 0xFF));
+    }
+
+    // Calibration and offsets of the last session, unless they are stale
+    bool offsets_loaded = storage_load();
+
+    // Raw sample capture, before the samplers record into it
+    capture_begin();
+
+    // Safty switch setup
+    pinMode(SAFETY_SWITCH_PIN, INPUT);
+    attachInterrupt(digitalPinToInterrupt(SAFETY_SWITCH_PIN), system_pause_isr, FALLING);
+    
+    // RPM measurement setup
+    // With bidirectional DShot the edges come from the ESC telemetry instead
+    if (!RPM_FROM_TELEMETRY) {
+        pinMode(RPM_DOUT_PIN, INPUT);
+        attachInterrupt(digitalPinToInterrupt(RPM_DOUT_PIN), rpm_counting_isr, RISING);
+    }
+
+    // Current and voltage sampling setup
+    pinMode(CURRENT_AOUT_PIN, INPUT);
+    pinMode(BAT_VOLTAGE_PIN, INPUT);
+    adc_calibrate();
+    FilterConfig current_config;
+    current_config.lowpass_hz = FILTER_CURRENT_LOWPASS_HZ;
+    current_filter.fs = ADC_SAMPLE_RATE_HZ;
+    filter_configure(current_filter, current_config);
+    adc_sampler_begin();
+    if (!offsets_loaded) current_offset = -measure_current();
+
+    // Thrust measurement setup
+    scale.begin(THRUST_DT_PIN, THRUST_SCK_PIN);
+    scale.set_scale(calibration.thrust_scale);
+    FilterConfig thrust_config;
+    thrust_config.lowpass_hz = FILTER_THRUST_LOWPASS_HZ;
+    thrust_filter.fs = THRUST_SPS;
+    filter_configure(thrust_filter, thrust_config);
+    thrust_sampler_begin();
+    if (!offsets_loaded) {
+        thrust_tare();
+        storage_save();
+    }
+
+    // ESC communication setup
+    esc_begin();
+    set_throttle(0.0);
+    xTaskCreatePinnedToCore(safety_task, "safety", 2048, nullptr, SAFETY_TASK_PRIORITY, &safety_task_handle, SAFETY_TASK_CORE);
+
+    // LEDs setup
+    pinMode(LED_GREEN_PIN, OUTPUT);
+    pinMode(LED_YELLOW_PIN, OUTPUT);
+    digitalWrite(LED_GREEN_PIN, HIGH);
+    digitalWrite(LED_YELLOW_PIN, LOW);
+    standby_ts = millis();
+
+    // Profile playback
+    profile_begin();
+
+    // Result pool, before the host link task: RESULT_HEAP_RESERVE leaves room for its stack
+    results_begin();
+
+    // Host link on the other core
+    xTaskCreatePinnedToCore(comm_task, "comm", COMM_TASK_STACK, nullptr, COMM_TASK_PRIORITY, &comm_task_handle, COMM_TASK_CORE);
+}
+
+//
+// Loop
+//
+
+void loop() {
+    scheduler_run();
+}
@@ -0,0 +1,417 @@
+# Serial link to the teststand controller: json lines or binary frames, shared by gui.py, bench.py and fleet.py.
+
+import json
+import struct
+import time
+import os
+import queue
+import threading
+import serial
+import pandas as pd
+
+#
+# Parameters
+#
+
+SERIAL_BAUD = 115200
+FAST_SERIAL_BAUD = 921600   # Baud used together with the binary protocol
+PROTOCOL_TIMEOUT = 2
+DUMP_TIMEOUT = 5  # Longest gap between two frames of a capture dump
+POLL_INTERVAL = 0.001  # Wait between two polls of an idle port, so several stands can be read side by side
+HEARTBEAT_INTERVAL = 1  # A session pings the controller after this long without a message
+HEARTBEAT_TIMEOUT = 3   # and takes the link as lost after this long
+QUEUED_COMMANDS = ('sys_init', 'quick_init', 'measure', 'ramp')  # Commands whose replies carry their "id"
+
+FRAME_JSON = 0x01
+FRAME_STEP = 0x02
+FRAME_RAMP_STEP = 0x03
+STEP_RECORD = struct.Struct('<H5fIH12f')  # seq, throttle, rpm, thrust, current, voltage, timestamp, settle_ms, stats
+STATS_CHANNELS = ('rpm', 'thrust', 'current', 'voltage')
+FRAME_CAPTURE_ADC = 0x04
+FRAME_CAPTURE_THRUST = 0x05
+FRAME_CAPTURE_RPM = 0x06
+CAPTURE_FRAMES = {  # Channel and sample layout of the raw capture frames, after their u16 seq
+    FRAME_CAPTURE_ADC: ('adc', struct.Struct('<IHH')),        # ts_us, current_mv, voltage_mv
+    FRAME_CAPTURE_THRUST: ('thrust', struct.Struct('<Ii')),   # ts_us, raw counts
+    FRAME_CAPTURE_RPM: ('rpm', struct.Struct('<I'))           # edge ts_us
+}
+
+#
+# Functions
+#
+
+# Counters of the traffic seen by read_message() and command(), for the benchmark reports.
+class LinkStats:
+    def __init__(self):
+        self.bytes = 0
+        self.messages = 0
+        self.malformed = 0
+
+
+# CRC-16/CCITT-FALSE, matching crc16() of the firmware.
+def crc16(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+# Undo the consistent overhead byte stuffing of one frame (without the 0x00 delimiter).
+def cobs_decode(data):
+    decoded = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            raise ValueError('Malformed COBS frame')
+        decoded += data[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(data):
+            decoded.append(0)
+    return bytes(decoded)
+
+
+# Turn one binary frame into the same message the json protocol would have sent.
+def decode_frame(frame):
+    raw = cobs_decode(frame)
+    if len(raw) < 3 or crc16(raw[:-2]) != int.from_bytes(raw[-2:], 'little'):
+        raise ValueError('Frame CRC mismatch')
+    frame_type, payload = raw[0], raw[1:-2]
+
+    if frame_type == FRAME_JSON:
+        return json.loads(payload.decode('utf-8'))
+    if frame_type in (FRAME_STEP, FRAME_RAMP_STEP):
+        seq, throttle, rpm, thrust, current, voltage, timestamp, settle_ms, *spread = STEP_RECORD.unpack(payload)
+        stats = {}
+        for i, channel in enumerate(STATS_CHANNELS):
+            stats[channel] = {'std': spread[3 * i], 'min': spread[3 * i + 1], 'max': spread[3 * i + 2]}
+        data = {'throttle': throttle, 'rpm': rpm, 'current': current, 'thrust': thrust, 'voltage': voltage,
+                'timestamp': timestamp, 'settle_ms': settle_ms, 'stats': stats}
+        response_type = 'measure_step' if frame_type == FRAME_STEP else 'ramp_step'
+        return {'response_type': response_type, 'seq': seq, 'data': data}
+    if frame_type in CAPTURE_FRAMES:
+        channel, layout = CAPTURE_FRAMES[frame_type]
+        seq = int.from_bytes(payload[:2], 'little')
+        return {'response_type': 'dump_chunk', 'channel': channel, 'seq': seq, 'samples': list(layout.iter_unpack(payload[2:]))}
+    raise ValueError(f'Unknown frame type {frame_type}')
+
+
+# Decode one message of the controller, a json line or a binary frame with its delimiter.
+def decode_message(raw, protocol):
+    if protocol == 'binary':
+        return decode_frame(raw[:-1])
+    return json.loads(raw.decode('utf-8').strip())
+
+
+# Read one message from the teststand controller, counting its bytes into link if given.
+def read_message(ser, protocol, link=None):
+    raw = ser.read_until(b'\x00') if protocol == 'binary' else ser.readline()
+    if link != None:
+        link.bytes += len(raw)
+        link.messages += 1
+    return decode_message(raw, protocol)
+
+
+# Poll ser for the messages of the controller: the returned function reads the next one, or gives None
+# once the port has been idle for POLL_INTERVAL.
+def port_messages(ser, protocol, link=None):
+    def next_message():
+        if not ser.in_waiting:
+            time.sleep(POLL_INTERVAL)
+            return None
+        return read_message(ser, protocol, link)
+    return next_message
+
+
+# Switch the controller (and the port) to another protocol and baud, return the protocol in use afterwards.
+def set_protocol(ser, current_protocol, protocol, baud):
+    cmd = {
+        'command_type': 'set_protocol',
+        'protocol': protocol,
+        'baud': baud
+    }
+    result = command(ser, cmd, 'set_protocol', PROTOCOL_TIMEOUT, protocol=current_protocol)
+    if result == None or result['ok'] != True:
+        print(f'Switching to the {protocol} protocol failed, staying with {current_protocol}.')
+        return current_protocol
+    ser.flush()
+    ser.baudrate = baud
+    ser.reset_input_buffer()
+    return protocol
+
+
+# Send a command to the teststand controller and wait for the response.
+# Streamed step records ('<response_type>_step') are passed to on_record as they arrive,
+# and collected into the 'data' of the final response. For streams the timeout applies between two frames.
+# A safety trip report arriving meanwhile is attached to the final response as 'trip'.
+# Frames that cannot be decoded are skipped, and counted into link if given.
+def command(ser, cmd, response_type, timeout, on_record=None, protocol='json', link=None):
+    ser.write((json.dumps(cmd) + '\n').encode())
+    ser.flush()
+    return wait_reply(port_messages(ser, protocol, link), response_type, timeout, on_record, link)
+
+
+# Collect the reply of a command from next_message, see command(). on_idle is called whenever no message
+# is waiting, so a GUI stays responsive while the controller works.
+def wait_reply(next_message, response_type, timeout, on_record=None, link=None, on_idle=None):
+    start_t = time.time()
+    records = []
+    trip = None
+
+    while True:
+        if time.time() - start_t > timeout:
+            print('Function command() timeout!')
+            return None
+        try:
+            result = next_message()
+            if result == None:
+                if on_idle != None:
+                    on_idle()
+                continue
+            if result['response_type'] == f'{response_type}_step':
+                if result['seq'] != len(records):
+                    print(f'Expected step record {len(records)}, got {result["seq"]}!')
+                records.append(result['data'])
+                start_t = time.time()
+                if on_record != None:
+                    on_record(result)
+                continue
+            if result['response_type'] == 'trip':
+                print(f'Safety trip: {result["reason"]} ({result["value"]:.2f})!')
+                trip = result
+                continue
+            assert result['response_type'] == response_type
+            # Streamed sweeps, and buffered ones in binary mode, send their steps as records
+            if result.get('stream', False) or 'data' not in result and 'count' in result:
+                if result['count'] != len(records):
+                    print(f'Expected {result["count"]} step records, got {len(records)}!')
+                result['data'] = records
+            if trip != None:
+                result['trip'] = trip
+            return result
+        except ValueError:
+            if link != None:
+                link.malformed += 1
+            continue
+        except:
+            continue
+
+
+# Fetch the raw sample capture of the controller (binary protocol only) and save it as csv files in storage_dir.
+def dump_capture(ser, storage_dir, protocol):
+    ser.write((json.dumps({'command_type': 'dump'}) + '\n').encode())
+    ser.flush()
+    return wait_dump(port_messages(ser, protocol), storage_dir)
+
+
+# Collect a capture dump from next_message, see dump_capture().
+def wait_dump(next_message, storage_dir):
+    start_t = time.time()
+    samples = {'adc': [], 'thrust': [], 'rpm': []}
+    frames = 0
+
+    while time.time() - start_t < DUMP_TIMEOUT:
+        try:
+            result = next_message()
+        except:
+            continue
+        if result == None:
+            continue
+        start_t = time.time()
+        if result['response_type'] == 'dump_chunk':
+            if result['seq'] != frames:
+                print(f'Expected capture frame {frames}, got {result["seq"]}!')
+            frames = result['seq'] + 1
+            samples[result['channel']] += result['samples']
+            continue
+        if result['response_type'] != 'dump':
+            continue
+        if result['ok'] != True:
+            print(f'Capture dump refused: {result.get("error")}')
+            return None
+
+        os.makedirs(storage_dir, exist_ok=True)
+        adc = pd.DataFrame(samples['adc'], columns=['ts_us', 'current_mv', 'voltage_mv'])
+        adc['current'] = adc['current_mv'] * 0.001 * result['current_scale'] + result['current_offset']
+        adc['voltage'] = adc['voltage_mv'] * 0.001 * result['voltage_scale']
+        adc.to_csv(f'{storage_dir}/capture_adc.csv', index=False)
+        thrust = pd.DataFrame(samples['thrust'], columns=['ts_us', 'raw'])
+        thrust['thrust'] = (thrust['raw'] - result['thrust_offset']) / result['thrust_scale']
+        thrust.to_csv(f'{storage_dir}/capture_thrust.csv', index=False)
+        pd.DataFrame(samples['rpm'], columns=['ts_us']).to_csv(f'{storage_dir}/capture_rpm.csv', index=False)
+        with open(f'{storage_dir}/capture.json', 'w') as f:
+            json.dump(result, f, indent=4)
+        return result
+
+    print('Capture dump timeout!')
+    return None
+
+
+# A request of a session waiting for its reply: the reader thread queues every message meant for it.
+class Request:
+    def __init__(self, response_type, id):
+        self.response_type = response_type
+        self.id = id
+        self.messages = queue.Queue()
+
+    # Replies of another command carry another id, steps and chunks have none but only one command streams at a time
+    def wants(self, message):
+        kind = message.get('response_type')
+        if kind == 'trip':
+            return True
+        if self.id != None and message.get('id', self.id) != self.id:
+            return False
+        if kind in ('queued', 'started'):
+            return message.get('command') == self.response_type
+        return kind in (self.response_type, f'{self.response_type}_step') or kind == 'dump_chunk' and self.response_type == 'dump'
+
+    def next_message(self):
+        try:
+            return self.messages.get(timeout=POLL_INTERVAL * 10)
+        except queue.Empty:
+            return None
+
+
+# Long-lived link to one controller. The port is opened once, without resetting the board, and a reader
+# thread decodes everything the controller sends: replies go to the request waiting for them, by "id" and
+# response_type, the rest to on_message. An idle link is pinged, alive turns False once the controller is silent.
+class Session:
+    def __init__(self, port, baud=SERIAL_BAUD):
+        ser = serial.serial_for_url(port, do_not_open=True)
+        ser.baudrate = baud
+        ser.timeout = POLL_INTERVAL * 10
+        # DTR and RTS drive EN and IO0 of the DevKitC, released so opening the port does not reboot the controller
+        ser.dtr = False
+        ser.rts = False
+        ser.open()
+        self.ser = ser
+        self.protocol = 'json'
+        self.link = LinkStats()
+        self.alive = True
+        self.on_message = None  # Called on the reader thread
+        self.lock = threading.Lock()  # Guards requests, next_id and the writes
+        self.requests = []
+        self.next_id = 1
+        self.last_rx_t = time.time()
+        self.last_ping_t = 0
+        self.closed = False
+        self.reader = threading.Thread(target=self.read_loop, daemon=True)
+        self.reader.start()
+
+    def write(self, cmd):
+        self.ser.write((json.dumps(cmd) + '\n').encode())
+        self.ser.flush()
+
+    # Send a command and register the request for its reply, queued commands are tagged with the next id.
+    def send(self, cmd, response_type):
+        with self.lock:
+            if cmd['command_type'] in QUEUED_COMMANDS and 'id' not in cmd:
+                cmd = dict(cmd, id=self.next_id)
+                self.next_id += 1
+            request = Request(response_type, cmd.get('id'))
+            self.requests.append(request)
+            self.write(cmd)
+        return request
+
+    # Send a control without waiting, its reply goes to on_message. Safe to call while command() waits.
+    def control(self, cmd):
+        with self.lock:
+            self.write(cmd)
+
+    # Same as command(), the port stays open.
+    def command(self, cmd, response_type, timeout, on_record=None, on_idle=None):
+        request = self.send(cmd, response_type)
+        try:
+            return wait_reply(request.next_message, response_type, timeout, on_record, on_idle=on_idle)
+        finally:
+            with self.lock:
+                self.requests.remove(request)
+
+    # Same as set_protocol(), the reader switches the decoding and the baud as soon as the reply arrives.
+    def set_protocol(self, protocol, baud):
+        cmd = {
+            'command_type': 'set_protocol',
+            'protocol': protocol,
+            'baud': baud
+        }
+        result = self.command(cmd, 'set_protocol', PROTOCOL_TIMEOUT)
+        if result == None or result['ok'] != True:
+            print(f'Switching to the {protocol} protocol failed, staying with {self.protocol}.')
+        return self.protocol
+
+    # Same as dump_capture().
+    def dump_capture(self, storage_dir):
+        request = self.send({'command_type': 'dump'}, 'dump')
+        try:
+            return wait_dump(request.next_message, storage_dir)
+        finally:
+            with self.lock:
+                self.requests.remove(request)
+
+    # Go back to json at the default baud, so the next session finds the controller as it booted.
+    def close(self):
+        if self.protocol != 'json' and self.alive:
+            self.set_protocol('json', SERIAL_BAUD)
+        self.closed = True
+        self.reader.join()
+        self.ser.close()
+
+    def read_loop(self):
+        buffer = b''
+        while not self.closed:
+            try:
+                chunk = self.ser.read(max(1, self.ser.in_waiting))
+            except serial.SerialException as e:
+                print(f'Serial link lost: {e}')
+                self.alive = False
+                return
+            if len(chunk) > 0:
+                self.last_rx_t = time.time()
+                self.alive = True
+                buffer = self.split(buffer + chunk)
+            self.heartbeat()
+
+    # Decode and dispatch the complete messages in buffer, return what is left of it.
+    def split(self, buffer):
+        while True:
+            end = buffer.find(b'\x00' if self.protocol == 'binary' else b'\n')
+            if end < 0:
+                return buffer
+            raw, buffer = buffer[:end + 1], buffer[end + 1:]
+            self.link.bytes += len(raw)
+            self.link.messages += 1
+            try:
+                message = decode_message(raw, self.protocol)
+            except Exception:
+                self.link.malformed += 1
+                continue
+            # The controller switches right after this reply, whatever follows is in the new protocol
+            if message.get('response_type') == 'set_protocol' and message.get('ok') == True:
+                self.protocol = message['protocol']
+                if message.get('baud', 0) > 0:
+                    self.ser.baudrate = message['baud']
+                    buffer = b''
+            self.dispatch(message)
+
+    def dispatch(self, message):
+        with self.lock:
+            targets = [request for request in self.requests if request.wants(message)]
+        for request in targets:
+            request.messages.put(message)
+        if len(targets) == 0 and message.get('response_type') != 'ping' and self.on_message != None:
+            self.on_message(message)
+
+    def heartbeat(self):
+        now = time.time()
+        if now - self.last_rx_t > HEARTBEAT_INTERVAL and now - self.last_ping_t > HEARTBEAT_INTERVAL:
+            self.last_ping_t = now
+            try:
+                with self.lock:
+                    self.write({'command_type': 'ping'})
+            except serial.SerialException:
+                pass
+        if now - self.last_rx_t > HEARTBEAT_TIMEOUT:
+            self.alive = False